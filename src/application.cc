@@ -1,15 +1,30 @@
 #include <QProcess>
+#include <QLocalSocket>
+#include <QTcpSocket>
+#include <QDebug>
+
+#ifdef Q_OS_UNIX
+#include <sys/socket.h>
+#endif
 
 #include "./application.h"
 #include "./nvim_ui_widget.h"
 #include "./nvim_ui_calc.h"
+#include "./tracer.h"
+
+#define CONNECT_TIMEOUT_MS 5000
+// sized to hold a full-screen redraw of a big grid in one go
+#define SOCKET_BUFFER_SIZE (1024 * 1024)
 
 Application::Application(int argc, char* argv[]): QApplication(argc, argv) {
     setAttribute(Qt::AA_MacDontSwapCtrlAndMeta, true);
 
-    std::unique_ptr<QProcess> proc(new QProcess);
+    startup_timer_.start();
+
+    NvimController::Options options;
+    QString server_address;
+    QString nvim_program = "nvim";
 
-    proc->setProgram("nvim");
     QStringList args({"--embed"});
     bool args_for_nvim = false;
     for (int i = 1 ; i < argc ; i += 1) {
@@ -19,13 +34,98 @@ Application::Application(int argc, char* argv[]): QApplication(argc, argv) {
         }
         if (args_for_nvim)
             args << argv[i];
+        else if (strcmp(argv[i], "--no-rpc-thread") == 0)
+            options.rpc_thread = false;
+        else if (strcmp(argv[i], "--nvim") == 0 && i + 1 < argc)
+            nvim_program = QString::fromLocal8Bit(argv[++i]);
+        else if (strcmp(argv[i], "--server") == 0 && i + 1 < argc)
+            server_address = QString::fromLocal8Bit(argv[++i]);
+        else if (strcmp(argv[i], "--capture") == 0 && i + 1 < argc)
+            options.capture_path = QString::fromLocal8Bit(argv[++i]);
+        else if (strcmp(argv[i], "--trace") == 0)
+            tracer::set_enabled(true);  // dump with the neoterminal_trace_dump rpc request
     }
+
+    std::unique_ptr<QIODevice> io;
+    if (server_address.isEmpty())
+        io = this->spawn_nvim(nvim_program, args);
+    else
+        io = this->connect_nvim(server_address);
+
+    nvim_controller_.reset(new NvimController(std::move(io), options));
+    nvim_controller_->ui_widget()->show();
+
+    first_frame_connection_ = connect(nvim_controller_->ui_calc(), &NvimUICalc::updated, this, [this]() {
+        qDebug() << "First frame after" << startup_timer_.elapsed() << "ms";
+        disconnect(first_frame_connection_);
+    });
+}
+
+// program: nvim, or anything speaking its protocol such as neoterminal-fake-nvim
+std::unique_ptr<QIODevice> Application::spawn_nvim(QString const& program, QStringList const& args) {
+    std::unique_ptr<QProcess> proc(new QProcess);
+
+    proc->setProgram(program);
     proc->setArguments(args);
     proc->start();
 
     connect(proc.get(), QOverload<int, QProcess::ExitStatus>::of(&QProcess::finished),
             proc.get(), &QIODevice::aboutToClose);
 
-    nvim_controller_.reset(new NvimController(std::move(proc)));
-    nvim_controller_->ui_widget()->show();
+    return proc;
+}
+
+// address: a unix socket path (or windows pipe name) or host:port, as given to nvim --listen
+std::unique_ptr<QIODevice> Application::connect_nvim(QString const& address) {
+    std::unique_ptr<QIODevice> ret;
+    bool connected = false;
+    QString error;
+
+    // host:port only if all after the last ':' is a port, so that paths
+    // such as C:\... stay local; an IPv6 host is in brackets ([::1]:6666)
+    int port_sep = address.lastIndexOf(':');
+    bool port_ok = false;
+    quint16 port = port_sep > 0 ? address.midRef(port_sep + 1).toUShort(&port_ok) : 0;
+    bool is_tcp = port_ok && !address.startsWith('/') && !address.startsWith('\\');
+
+    if (is_tcp) {
+        QString host = address.left(port_sep);
+        if (host.startsWith('[') && host.endsWith(']'))
+            host = host.mid(1, host.size() - 2);
+        std::unique_ptr<QTcpSocket> socket(new QTcpSocket);
+        socket->connectToHost(host, port);
+        connected = socket->waitForConnected(CONNECT_TIMEOUT_MS);
+        if (connected) {
+            // keystrokes are tiny writes that should go out right away
+            socket->setSocketOption(QAbstractSocket::LowDelayOption, 1);
+            socket->setSocketOption(QAbstractSocket::SendBufferSizeSocketOption, SOCKET_BUFFER_SIZE);
+            socket->setSocketOption(QAbstractSocket::ReceiveBufferSizeSocketOption, SOCKET_BUFFER_SIZE);
+        }
+        error = socket->errorString();
+        connect(socket.get(), &QAbstractSocket::disconnected,
+                socket.get(), &QIODevice::aboutToClose);
+        ret = std::move(socket);
+    } else {
+        std::unique_ptr<QLocalSocket> socket(new QLocalSocket);
+        socket->connectToServer(address);
+        connected = socket->waitForConnected(CONNECT_TIMEOUT_MS);
+#ifdef Q_OS_UNIX
+        if (connected) {
+            int size = SOCKET_BUFFER_SIZE;
+            setsockopt(socket->socketDescriptor(), SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+            setsockopt(socket->socketDescriptor(), SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+        }
+#endif
+        error = socket->errorString();
+        connect(socket.get(), &QLocalSocket::disconnected,
+                socket.get(), &QIODevice::aboutToClose);
+        ret = std::move(socket);
+    }
+
+    if (!connected)
+        qFatal("Unable to connect to nvim at %s: %s",
+               address.toLocal8Bit().constData(), error.toLocal8Bit().constData());
+
+    qDebug() << "Connected to nvim at" << address << "after" << startup_timer_.elapsed() << "ms";
+    return ret;
 }
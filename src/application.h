@@ -1,6 +1,11 @@
 #pragma once
 
 #include <QApplication>
+#include <QElapsedTimer>
+#include <QIODevice>
+#include <QStringList>
+
+#include <memory>
 
 #include "./msgpack_rpc.h"
 #include "./nvim_ui_widget.h"
@@ -13,6 +18,12 @@ class Application: public QApplication {
 private:
     std::unique_ptr<NvimController> nvim_controller_;
 
+    QElapsedTimer startup_timer_;
+    QMetaObject::Connection first_frame_connection_;
+
+    std::unique_ptr<QIODevice> spawn_nvim(QString const& program, QStringList const& args);
+    std::unique_ptr<QIODevice> connect_nvim(QString const& address);
+
 public:
     Application(int argc, char* argv[]);
 };
@@ -0,0 +1,44 @@
+#include <algorithm>
+#include <climits>
+
+#include "./dirty_spans.h"
+
+const DirtySpans::Span DirtySpans::EMPTY_SPAN = {INT_MAX, INT_MIN};
+
+void DirtySpans::mark(int row, int begin, int end) {
+    begin = std::max(begin, 0);
+    if (row < 0 || begin >= end)
+        return;
+
+    if (spans_.size() <= size_t(row))
+        spans_.resize(row + 1, EMPTY_SPAN);
+
+    if (this->empty()) {
+        first_row_ = row;
+        last_row_ = row + 1;
+    } else {
+        first_row_ = std::min(first_row_, row);
+        last_row_ = std::max(last_row_, row + 1);
+    }
+
+    auto& span = spans_[row];
+    span.first = std::min(span.first, begin);
+    span.second = std::max(span.second, end);
+}
+
+void DirtySpans::mark(QRect const& cells) {
+    for (int y = std::max(cells.top(), 0) ; y <= cells.bottom() ; y += 1)
+        this->mark(y, cells.left(), cells.right() + 1);
+}
+
+void DirtySpans::merge(DirtySpans const& other) {
+    for (int y = other.first_row_ ; y < other.last_row_ ; y += 1)
+        this->mark(y, other.spans_[y].first, other.spans_[y].second);
+}
+
+void DirtySpans::clear() {
+    // rows outside [first_row_, last_row_) are EMPTY_SPAN already
+    for (int y = first_row_ ; y < last_row_ ; y += 1)
+        spans_[y] = EMPTY_SPAN;
+    first_row_ = last_row_ = 0;
+}
@@ -0,0 +1,41 @@
+#pragma once
+
+#include <QRect>
+
+#include <utility>
+#include <vector>
+
+// Damage of a grid as one [begin, end) column span per row. Marking and
+// merging are O(rows touched), unlike QRegion unions whose cost grows with
+// the number of small rects (one per grid_line).
+class DirtySpans {
+public:
+    using Span = std::pair<int, int>;
+
+    static const Span EMPTY_SPAN;
+
+    void mark(int row, int begin, int end);
+    // negative parts are clipped
+    void mark(QRect const& cells);
+    void merge(DirtySpans const& other);
+    // keeps the buffer
+    void clear();
+
+    bool empty() const { return first_row_ >= last_row_; }
+    // rows that may be dirty: [first_row(), last_row())
+    int first_row() const { return first_row_; }
+    int last_row() const { return last_row_; }
+
+    Span row(int row) const {
+        return row >= first_row_ && row < last_row_ ? spans_[row] : EMPTY_SPAN;
+    }
+    bool intersects(int row, int begin, int end) const {
+        Span span = this->row(row);
+        return span.first < end && begin < span.second && begin < end;
+    }
+
+private:
+    std::vector<Span> spans_;
+    int first_row_ = 0;
+    int last_row_ = 0;
+};
@@ -0,0 +1,435 @@
+// A stand-in for `nvim --embed` that generates synthetic redraw workloads,
+// to benchmark the GUI end to end without nvim itself.
+//
+// It answers nvim_ui_attach / nvim_ui_try_resize (anything else gets a nil
+// result) and then keeps sending ext_linegrid redraw batches:
+//
+//   neoterminal --nvim neoterminal-fake-nvim -- --workload scroll --rate 2000
+//
+//   --workload NAME   scroll:     full-screen scroll, RATE lines/s
+//                     churn:      random grid_line segments, RATE lines/s
+//                     highlights: redefine highlights and redraw the screen, RATE defs/s
+//                     cursor:     cursor-only movement, RATE moves/s
+//   --rate N          see above (default 1000)
+//   --fps N           redraw batches (each ending with flush) per second (default 60)
+//   --duration S      exit after S seconds (default: run until stdin closes)
+//   --seed N          seed of the random contents
+
+#include <poll.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <msgpack.hpp>
+
+namespace {
+
+const int NUM_HIGHLIGHTS = 16;
+
+struct Options {
+    std::string workload = "scroll";
+    double rate = 1000;
+    double fps = 60;
+    double duration = 0;
+    unsigned seed = 0;
+};
+
+using packer_t = msgpack::packer<msgpack::sbuffer>;
+
+// Collects the events of one redraw batch. Every event is packed on its own,
+// since the outer array length is only known at the end.
+class RedrawBatch {
+    std::deque<msgpack::sbuffer> events_;
+
+public:
+    // starts ["name", [args...], ...]; the caller packs `ncalls` args
+    // arrays into the returned buffer
+    msgpack::sbuffer& event(const char* name, uint32_t ncalls) {
+        events_.emplace_back();
+        packer_t pk(events_.back());
+        pk.pack_array(1 + ncalls);
+        pk.pack(std::string(name));
+        return events_.back();
+    }
+
+    bool empty() const { return events_.empty(); }
+
+    void write_to(msgpack::sbuffer& out) {
+        packer_t pk(out);
+        pk.pack_array(3);
+        pk.pack(2);
+        pk.pack(std::string("redraw"));
+        pk.pack_array(events_.size());
+        for (auto const& event: events_)
+            out.write(event.data(), event.size());
+        events_.clear();
+    }
+};
+
+class FakeNvim {
+    Options options_;
+    std::mt19937 rng_;
+
+    int width_ = 0, height_ = 0;
+    bool attached_ = false;
+    double pending_units_ = 0;  // fractional work carried over between ticks
+
+    msgpack::unpacker unpacker_;
+    msgpack::sbuffer out_;
+
+public:
+    explicit FakeNvim(Options const& options): options_(options), rng_(options.seed) {}
+
+    int run();
+
+private:
+    bool read_input();
+    void handle_message(msgpack::object const& obj);
+    void handle_request(uint32_t msgid, std::string const& method, msgpack::object const& params);
+    void handle_call(std::string const& method, msgpack::object const& params);
+
+    void write_output();
+
+    void tick(double dt);
+    void full_redraw(RedrawBatch& batch);
+    void flush(RedrawBatch& batch);
+    void random_line(RedrawBatch& batch, int row, int col_start, int col_end);
+
+    int random_int(int lo, int hi) {  // [lo, hi]
+        return std::uniform_int_distribution<int>(lo, hi)(rng_);
+    }
+};
+
+int FakeNvim::run() {
+    using clock = std::chrono::steady_clock;
+
+    auto tick_interval = std::chrono::duration<double>(1.0 / options_.fps);
+    auto start = clock::now();
+    auto last_tick = start;
+    auto next_tick = start;
+
+    while (true) {
+        auto now = clock::now();
+        if (options_.duration > 0 && now - start >= std::chrono::duration<double>(options_.duration))
+            return 0;
+
+        int timeout_ms = 0;
+        if (next_tick > now)
+            timeout_ms = std::chrono::duration_cast<std::chrono::milliseconds>(next_tick - now).count();
+        if (!attached_)
+            timeout_ms = -1;
+
+        struct pollfd pfd = {STDIN_FILENO, POLLIN, 0};
+        int ret = poll(&pfd, 1, timeout_ms);
+        if (ret < 0 && errno != EINTR) {
+            perror("poll");
+            return 1;
+        }
+        if (ret > 0 && !this->read_input())
+            return 0;
+
+        now = clock::now();
+        if (attached_ && now >= next_tick) {
+            this->tick(std::chrono::duration<double>(now - last_tick).count());
+            last_tick = now;
+            next_tick += std::chrono::duration_cast<clock::duration>(tick_interval);
+            if (next_tick < now)  // fell behind (the GUI is not reading fast enough)
+                next_tick = now;
+        }
+
+        this->write_output();
+    }
+}
+
+bool FakeNvim::read_input() {
+    unpacker_.reserve_buffer(64 * 1024);
+    ssize_t n = read(STDIN_FILENO, unpacker_.buffer(), unpacker_.buffer_capacity());
+    if (n <= 0)
+        return false;
+    unpacker_.buffer_consumed(n);
+
+    msgpack::object_handle result;
+    while (unpacker_.next(result))
+        this->handle_message(result.get());
+    return true;
+}
+
+void FakeNvim::handle_message(msgpack::object const& obj) {
+    if (obj.type != msgpack::type::ARRAY || obj.via.array.size < 3)
+        return;
+    auto const& body = obj.via.array;
+
+    try {
+        int type = body.ptr[0].as<int>();
+        if (type == 0 && body.size == 4)
+            this->handle_request(body.ptr[1].as<uint32_t>(), body.ptr[2].as<std::string>(), body.ptr[3]);
+        else if (type == 2 && body.size == 3)
+            this->handle_call(body.ptr[1].as<std::string>(), body.ptr[2]);
+    } catch (msgpack::type_error const&) {
+        std::cerr << "fake-nvim: malformed message " << obj << std::endl;
+    }
+}
+
+void FakeNvim::handle_request(uint32_t msgid, std::string const& method, msgpack::object const& params) {
+    packer_t pk(out_);
+    pk.pack_array(4);
+    pk.pack(1);
+    pk.pack(msgid);
+    pk.pack_nil();
+    if (method == "nvim_get_api_info") {
+        pk.pack_array(2);
+        pk.pack(1);  // channel id
+        pk.pack_map(0);
+    } else {
+        pk.pack_nil();
+    }
+
+    this->handle_call(method, params);
+}
+
+// both requests and notifications
+void FakeNvim::handle_call(std::string const& method, msgpack::object const& params) {
+    if (method != "nvim_ui_attach" && method != "nvim_ui_try_resize")
+        return;
+    if (params.type != msgpack::type::ARRAY || params.via.array.size < 2)
+        return;
+
+    auto const& args = params.via.array;
+
+    width_ = std::max(1, args.ptr[0].as<int>());
+    height_ = std::max(2, args.ptr[1].as<int>());
+
+    RedrawBatch batch;
+    if (method == "nvim_ui_attach") {
+        attached_ = true;
+
+        packer_t colors_pk(batch.event("default_colors_set", 1));
+        colors_pk.pack_array(5);
+        colors_pk.pack(0xd0d0d0); colors_pk.pack(0x1c1c1c); colors_pk.pack(0xff0000);
+        colors_pk.pack(-1); colors_pk.pack(-1);
+
+        for (int id = 1 ; id <= NUM_HIGHLIGHTS ; id += 1) {
+            packer_t pk(batch.event("hl_attr_define", 1));
+            pk.pack_array(4);
+            pk.pack(id);
+            pk.pack_map(2);
+            pk.pack(std::string("foreground"));
+            pk.pack(random_int(0x404040, 0xffffff));
+            pk.pack(std::string("bold"));
+            pk.pack(id % 4 == 0);
+            pk.pack_map(0);
+            pk.pack_array(0);
+        }
+
+        packer_t mode_info_pk(batch.event("mode_info_set", 1));
+        mode_info_pk.pack_array(2);
+        mode_info_pk.pack(true);
+        mode_info_pk.pack_array(1);
+        mode_info_pk.pack_map(4);
+        mode_info_pk.pack(std::string("cursor_shape")); mode_info_pk.pack(std::string("block"));
+        mode_info_pk.pack(std::string("cell_percentage")); mode_info_pk.pack(100);
+        mode_info_pk.pack(std::string("name")); mode_info_pk.pack(std::string("normal"));
+        mode_info_pk.pack(std::string("short_name")); mode_info_pk.pack(std::string("n"));
+
+        packer_t mode_pk(batch.event("mode_change", 1));
+        mode_pk.pack_array(2);
+        mode_pk.pack(std::string("normal"));
+        mode_pk.pack(0);
+    }
+
+    packer_t pk(batch.event("grid_resize", 1));
+    pk.pack_array(3); pk.pack(1); pk.pack(width_); pk.pack(height_);
+
+    this->full_redraw(batch);
+    this->flush(batch);
+    batch.write_to(out_);
+}
+
+void FakeNvim::write_output() {
+    const char* data = out_.data();
+    size_t size = out_.size();
+    while (size > 0) {
+        ssize_t n = write(STDOUT_FILENO, data, size);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("write");
+            exit(1);
+        }
+        data += n;
+        size -= n;
+    }
+    out_.clear();
+}
+
+void FakeNvim::full_redraw(RedrawBatch& batch) {
+    packer_t clear_pk(batch.event("grid_clear", 1));
+    clear_pk.pack_array(1); clear_pk.pack(1);
+
+    for (int row = 0 ; row < height_ ; row += 1)
+        this->random_line(batch, row, 0, width_);
+
+    packer_t cursor_pk(batch.event("grid_cursor_goto", 1));
+    cursor_pk.pack_array(3); cursor_pk.pack(1); cursor_pk.pack(height_ - 1); cursor_pk.pack(0);
+}
+
+void FakeNvim::flush(RedrawBatch& batch) {
+    packer_t pk(batch.event("flush", 1));
+    pk.pack_array(0);
+}
+
+// Like nvim: words with a highlight each, the highlight id is only sent when
+// it changes, and runs of the same char are sent once with a repeat count
+void FakeNvim::random_line(RedrawBatch& batch, int row, int col_start, int col_end) {
+    static const char WORD_CHARS[] = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789_(){}[];,.";
+
+    std::vector<std::pair<char, int>> cells;  // (char, hl)
+    while ((int)cells.size() < col_end - col_start) {
+        int hl = random_int(0, NUM_HIGHLIGHTS);
+        int word = random_int(1, 12);
+        for (int i = 0 ; i < word ; i += 1)
+            cells.emplace_back(WORD_CHARS[random_int(0, sizeof(WORD_CHARS) - 2)], hl);
+        int spaces = random_int(1, 3) * (random_int(0, 8) == 0 ? 8 : 1);
+        for (int i = 0 ; i < spaces ; i += 1)
+            cells.emplace_back(' ', 0);
+    }
+    cells.resize(col_end - col_start);
+
+    // count runs first, the array length goes first
+    std::vector<std::pair<size_t, int>> runs;  // (start, repeat)
+    for (size_t i = 0 ; i < cells.size() ;) {
+        size_t j = i + 1;
+        while (j < cells.size() && cells[j] == cells[i])
+            j += 1;
+        runs.emplace_back(i, j - i);
+        i = j;
+    }
+
+    packer_t pk(batch.event("grid_line", 1));
+    pk.pack_array(4);
+    pk.pack(1);
+    pk.pack(row);
+    pk.pack(col_start);
+    pk.pack_array(runs.size());
+
+    int last_hl = -1;
+    for (auto const& run: runs) {
+        auto const& cell = cells[run.first];
+        bool send_hl = cell.second != last_hl || run.second > 1;
+        pk.pack_array(run.second > 1 ? 3 : (send_hl ? 2 : 1));
+        pk.pack_str(1);
+        pk.pack_str_body(&cell.first, 1);
+        if (send_hl)
+            pk.pack(cell.second);
+        if (run.second > 1)
+            pk.pack(run.second);
+        last_hl = cell.second;
+    }
+}
+
+void FakeNvim::tick(double dt) {
+    pending_units_ += options_.rate * dt;
+    int units = (int)pending_units_;
+    pending_units_ -= units;
+
+    RedrawBatch batch;
+
+    if (options_.workload == "scroll") {
+        // the last row stays, like a status line
+        for (int i = 0 ; i < units ; i += 1) {
+            packer_t pk(batch.event("grid_scroll", 1));
+            pk.pack_array(7);
+            pk.pack(1); pk.pack(0); pk.pack(height_ - 1); pk.pack(0); pk.pack(width_); pk.pack(1); pk.pack(0);
+            this->random_line(batch, height_ - 2, 0, width_);
+        }
+    } else if (options_.workload == "churn") {
+        for (int i = 0 ; i < units ; i += 1) {
+            int col_start = random_int(0, width_ - 1);
+            int col_end = random_int(col_start + 1, width_);
+            this->random_line(batch, random_int(0, height_ - 1), col_start, col_end);
+        }
+    } else if (options_.workload == "highlights") {
+        for (int i = 0 ; i < units ; i += 1) {
+            packer_t pk(batch.event("hl_attr_define", 1));
+            pk.pack_array(4);
+            pk.pack(random_int(1, NUM_HIGHLIGHTS));
+            pk.pack_map(3);
+            pk.pack(std::string("foreground"));
+            pk.pack(random_int(0x404040, 0xffffff));
+            pk.pack(std::string("background"));
+            pk.pack(random_int(0, 0x303030));
+            pk.pack(std::string("italic"));
+            pk.pack(random_int(0, 1) == 1);
+            pk.pack_map(0);
+            pk.pack_array(0);
+        }
+        // as after :colorscheme, nvim redraws everything using them
+        if (units > 0)
+            this->full_redraw(batch);
+    } else if (options_.workload == "cursor") {
+        for (int i = 0 ; i < units ; i += 1) {
+            packer_t pk(batch.event("grid_cursor_goto", 1));
+            pk.pack_array(3); pk.pack(1); pk.pack(random_int(0, height_ - 1)); pk.pack(random_int(0, width_ - 1));
+        }
+    }
+
+    if (batch.empty())
+        return;
+    this->flush(batch);
+    batch.write_to(out_);
+}
+
+void usage(const char* argv0) {
+    std::cerr << "Usage: " << argv0
+        << " [--workload scroll|churn|highlights|cursor] [--rate N] [--fps N] [--duration S] [--seed N]"
+        << std::endl;
+}
+
+}
+
+int main(int argc, char* argv[]) {
+    Options options;
+
+    for (int i = 1 ; i < argc ; i += 1) {
+        bool has_value = i + 1 < argc;
+        if (strcmp(argv[i], "--embed") == 0)
+            continue;  // as passed by neoterminal
+        else if (strcmp(argv[i], "--workload") == 0 && has_value)
+            options.workload = argv[++i];
+        else if (strcmp(argv[i], "--rate") == 0 && has_value)
+            options.rate = atof(argv[++i]);
+        else if (strcmp(argv[i], "--fps") == 0 && has_value)
+            options.fps = atof(argv[++i]);
+        else if (strcmp(argv[i], "--duration") == 0 && has_value)
+            options.duration = atof(argv[++i]);
+        else if (strcmp(argv[i], "--seed") == 0 && has_value)
+            options.seed = atoi(argv[++i]);
+        else {
+            usage(argv[0]);
+            return 2;
+        }
+    }
+
+    if (options.workload != "scroll" && options.workload != "churn"
+        && options.workload != "highlights" && options.workload != "cursor") {
+        usage(argv[0]);
+        return 2;
+    }
+    if (options.fps <= 0 || options.rate < 0) {
+        usage(argv[0]);
+        return 2;
+    }
+
+    FakeNvim nvim(options);
+    return nvim.run();
+}
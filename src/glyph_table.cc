@@ -0,0 +1,99 @@
+#include "./glyph_table.h"
+
+#include <algorithm>
+#include <cassert>
+#include <utility>
+
+namespace {
+
+// East Asian Wide (W) and Fullwidth (F) ranges, and the emoji shown as wide
+const std::pair<char32_t, char32_t> WIDE_RANGES[] = {
+    {0x1100, 0x115f}, {0x231a, 0x231b}, {0x2329, 0x232a}, {0x23e9, 0x23ec},
+    {0x23f0, 0x23f0}, {0x23f3, 0x23f3}, {0x25fd, 0x25fe}, {0x2614, 0x2615},
+    {0x2648, 0x2653}, {0x267f, 0x267f}, {0x2693, 0x2693}, {0x26a1, 0x26a1},
+    {0x26aa, 0x26ab}, {0x26bd, 0x26be}, {0x26c4, 0x26c5}, {0x26ce, 0x26ce},
+    {0x26d4, 0x26d4}, {0x26ea, 0x26ea}, {0x26f2, 0x26f3}, {0x26f5, 0x26f5},
+    {0x26fa, 0x26fa}, {0x26fd, 0x26fd}, {0x2705, 0x2705}, {0x270a, 0x270b},
+    {0x2728, 0x2728}, {0x274c, 0x274c}, {0x274e, 0x274e}, {0x2753, 0x2755},
+    {0x2757, 0x2757}, {0x2795, 0x2797}, {0x27b0, 0x27b0}, {0x27bf, 0x27bf},
+    {0x2b1b, 0x2b1c}, {0x2b50, 0x2b50}, {0x2b55, 0x2b55}, {0x2e80, 0x303e},
+    {0x3041, 0x33ff}, {0x3400, 0x4dbf}, {0x4e00, 0x9fff}, {0xa000, 0xa4cf},
+    {0xa960, 0xa97f}, {0xac00, 0xd7a3}, {0xf900, 0xfaff}, {0xfe10, 0xfe19},
+    {0xfe30, 0xfe6f}, {0xff00, 0xff60}, {0xffe0, 0xffe6}, {0x16fe0, 0x16fe4},
+    {0x17000, 0x18cff}, {0x1b000, 0x1b2ff}, {0x1f004, 0x1f004}, {0x1f0cf, 0x1f0cf},
+    {0x1f18e, 0x1f18e}, {0x1f191, 0x1f19a}, {0x1f200, 0x1f202}, {0x1f210, 0x1f23b},
+    {0x1f240, 0x1f248}, {0x1f250, 0x1f251}, {0x1f260, 0x1f265}, {0x1f300, 0x1f320},
+    {0x1f32d, 0x1f335}, {0x1f337, 0x1f37c}, {0x1f37e, 0x1f393}, {0x1f3a0, 0x1f3ca},
+    {0x1f3cf, 0x1f3d3}, {0x1f3e0, 0x1f3f0}, {0x1f3f4, 0x1f3f4}, {0x1f3f8, 0x1f43e},
+    {0x1f440, 0x1f440}, {0x1f442, 0x1f4fc}, {0x1f4ff, 0x1f53d}, {0x1f54b, 0x1f54e},
+    {0x1f550, 0x1f567}, {0x1f57a, 0x1f57a}, {0x1f595, 0x1f596}, {0x1f5a4, 0x1f5a4},
+    {0x1f5fb, 0x1f64f}, {0x1f680, 0x1f6c5}, {0x1f6cc, 0x1f6cc}, {0x1f6d0, 0x1f6d2},
+    {0x1f6d5, 0x1f6d7}, {0x1f6eb, 0x1f6ec}, {0x1f6f4, 0x1f6fc}, {0x1f7e0, 0x1f7eb},
+    {0x1f90c, 0x1f93a}, {0x1f93c, 0x1f945}, {0x1f947, 0x1f9ff}, {0x1fa70, 0x1faff},
+    {0x20000, 0x2fffd}, {0x30000, 0x3fffd},
+};
+
+int char_cells(char32_t c) {
+    if (c < 0x300)
+        return 1;
+    // zero width space / joiners, variation selectors
+    if ((c >= 0x200b && c <= 0x200f) || (c >= 0xfe00 && c <= 0xfe0f) || (c >= 0xe0100 && c <= 0xe01ef))
+        return 0;
+    switch (QChar::category(uint(c))) {
+    case QChar::Mark_NonSpacing:
+    case QChar::Mark_Enclosing:
+        return 0;
+    default:
+        break;
+    }
+    auto it = std::upper_bound(std::begin(WIDE_RANGES), std::end(WIDE_RANGES), c,
+                               [](char32_t c, std::pair<char32_t, char32_t> const& range) {
+                                   return c < range.first;
+                               });
+    if (it != std::begin(WIDE_RANGES) && c <= std::prev(it)->second)
+        return 2;
+    return 1;
+}
+
+}  // namespace
+
+GlyphTable::GlyphTable() {
+    utf16s_.reserve(ASCII_END);
+    for (glyph_id_t id = 0 ; id < ASCII_END ; id += 1) {
+        if (id == EMPTY)
+            utf8s_.emplace_back();
+        else
+            utf8s_.emplace_back(1, char(id));
+        utf16s_.push_back(QString::fromLatin1(utf8s_.back().data(), utf8s_.back().size()));
+    }
+}
+
+GlyphTable::glyph_id_t GlyphTable::intern(std::string_view utf8) {
+    if (utf8.empty())
+        return EMPTY;
+    if (utf8.size() == 1 && uint8_t(utf8[0]) < ASCII_END)
+        return glyph_id_t(uint8_t(utf8[0]));
+
+    auto it = ids_.find(utf8);
+    if (it != ids_.end())
+        return it->second;
+
+    glyph_id_t id = utf8s_.size();
+    utf8s_.emplace_back(utf8);
+    utf16s_.push_back(QString::fromUtf8(utf8.data(), utf8.size()));
+    ids_.emplace(utf8s_.back(), id);
+    return id;
+}
+
+int GlyphTable::cell_width(QString const& text) {
+    int cells = 0;
+    for (int i = 0 ; i < text.size() ; i += 1) {
+        char32_t c = text.at(i).unicode();
+        if (text.at(i).isHighSurrogate() && i + 1 < text.size() && text.at(i + 1).isLowSurrogate()) {
+            c = QChar::surrogateToUcs4(text.at(i), text.at(i + 1));
+            i += 1;
+        }
+        cells += char_cells(c);
+    }
+    return cells;
+}
@@ -0,0 +1,56 @@
+#pragma once
+
+#include <QString>
+
+#include <cstdint>
+#include <deque>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+// Interned cell texts (graphemes). A cell stores a 32-bit glyph id, so
+// copying and comparing cells is integer work.
+// ASCII is pre-seeded with id == the byte (and id 0 for the empty text of
+// the right half of a double width char); other graphemes get an id on first
+// sight, which stays valid for the lifetime of the table.
+class GlyphTable {
+public:
+    using glyph_id_t = uint32_t;
+
+    static const glyph_id_t EMPTY = 0;
+    static const glyph_id_t SPACE = ' ';
+    static const glyph_id_t ASCII_END = 0x80;
+
+    GlyphTable();
+
+    glyph_id_t intern(std::string_view utf8);
+
+    static bool is_ascii(glyph_id_t id) { return id < ASCII_END; }
+
+    // in cells, for text nvim does not lay out on the grid (popupmenu,
+    // cmdline): 2 for east asian wide / fullwidth chars and emoji, 0 for
+    // combining marks and joiners, like nvim's utf_char2cells()
+    static int cell_width(QString const& text);
+
+    std::string_view utf8(glyph_id_t id) const { return utf8s_[id]; }
+    QString const& utf16(glyph_id_t id) const { return utf16s_[id]; }
+
+    // appends the utf-16 text of a glyph
+    void append_to(glyph_id_t id, QString& out) const {
+        if (is_ascii(id)) {
+            if (id != EMPTY)
+                out += QChar(char16_t(id));
+        } else {
+            out += utf16s_[id];
+        }
+    }
+
+    size_t size() const { return utf8s_.size(); }
+
+private:
+    // deque: keys of ids_ point into its strings, which must not move
+    std::deque<std::string> utf8s_;
+    std::vector<QString> utf16s_;
+    std::unordered_map<std::string_view, glyph_id_t> ids_;
+};
@@ -0,0 +1,47 @@
+#include "./latency_histogram.h"
+
+#include <algorithm>
+
+void LatencyHistogram::record(std::chrono::steady_clock::duration duration) {
+    this->record_us(std::chrono::duration_cast<std::chrono::microseconds>(duration).count());
+}
+
+void LatencyHistogram::record_us(int64_t us) {
+    us = std::max<int64_t>(us, 0);
+
+    int bucket = 0;
+    while (bucket < NBUCKETS - 1 && (int64_t(2) << bucket) <= us)
+        bucket += 1;
+
+    buckets_[bucket].fetch_add(1, std::memory_order_relaxed);
+    count_.fetch_add(1, std::memory_order_relaxed);
+    sum_us_.fetch_add(us, std::memory_order_relaxed);
+
+    int64_t max_us = max_us_.load(std::memory_order_relaxed);
+    while (us > max_us && !max_us_.compare_exchange_weak(max_us, us, std::memory_order_relaxed))
+        ;
+}
+
+int64_t LatencyHistogram::percentile_us(uint64_t count, double p) const {
+    uint64_t target = std::max<uint64_t>(1, count * p);
+    uint64_t seen = 0;
+    for (int i = 0 ; i < NBUCKETS ; i += 1) {
+        seen += buckets_[i].load(std::memory_order_relaxed);
+        if (seen >= target)
+            return int64_t(2) << i;
+    }
+    return max_us_.load(std::memory_order_relaxed);
+}
+
+LatencyHistogram::Summary LatencyHistogram::summary() const {
+    Summary ret;
+    ret.count = count_.load(std::memory_order_relaxed);
+    if (ret.count == 0)
+        return ret;
+
+    ret.mean_us = sum_us_.load(std::memory_order_relaxed) / ret.count;
+    ret.max_us = max_us_.load(std::memory_order_relaxed);
+    ret.p50_us = std::min(ret.max_us, this->percentile_us(ret.count, 0.5));
+    ret.p99_us = std::min(ret.max_us, this->percentile_us(ret.count, 0.99));
+    return ret;
+}
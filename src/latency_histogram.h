@@ -0,0 +1,35 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+// Log-scale latency histogram: bucket 0 counts samples in [0, 2) us, bucket
+// i > 0 those in [2^i, 2^(i+1)) us.
+// record() is lock-free and may be called from any thread.
+class LatencyHistogram {
+public:
+    static const int NBUCKETS = 32;
+
+    struct Summary {
+        uint64_t count = 0;
+        int64_t mean_us = 0;
+        int64_t p50_us = 0;  // upper bounds of the buckets
+        int64_t p99_us = 0;
+        int64_t max_us = 0;
+    };
+
+    void record(std::chrono::steady_clock::duration duration);
+    void record_us(int64_t us);
+
+    Summary summary() const;
+
+private:
+    std::array<std::atomic<uint64_t>, NBUCKETS> buckets_ = {};
+    std::atomic<uint64_t> count_ = {0};
+    std::atomic<uint64_t> sum_us_ = {0};
+    std::atomic<int64_t> max_us_ = {0};
+
+    int64_t percentile_us(uint64_t count, double p) const;
+};
@@ -0,0 +1,92 @@
+#include "./msgpack_decode.h"
+
+msgpack::object const* MsgpackMapView::find(std::string_view key) const {
+    for (uint32_t i = 0 ; i < map_.size ; i += 1) {
+        auto const& kv = map_.ptr[i];
+        if (kv.key.type == msgpack::type::STR
+            && std::string_view(kv.key.via.str.ptr, kv.key.via.str.size) == key)
+            return &kv.val;
+    }
+    return nullptr;
+}
+
+namespace msgpack_decode {
+
+bool decode(msgpack::object const& obj, int64_t& value) {
+    if (obj.type == msgpack::type::POSITIVE_INTEGER) {
+        value = obj.via.u64;
+        return true;
+    }
+    if (obj.type == msgpack::type::NEGATIVE_INTEGER) {
+        value = obj.via.i64;
+        return true;
+    }
+    return false;
+}
+
+bool decode(msgpack::object const& obj, int& value) {
+    int64_t value64;
+    if (!decode(obj, value64))
+        return false;
+    value = value64;
+    return true;
+}
+
+bool decode(msgpack::object const& obj, bool& value) {
+    if (obj.type != msgpack::type::BOOLEAN)
+        return false;
+    value = obj.via.boolean;
+    return true;
+}
+
+bool decode(msgpack::object const& obj, double& value) {
+    if (obj.type == msgpack::type::FLOAT32 || obj.type == msgpack::type::FLOAT64) {
+        value = obj.via.f64;
+        return true;
+    }
+    int64_t value64;
+    if (!decode(obj, value64))
+        return false;
+    value = value64;
+    return true;
+}
+
+bool decode(msgpack::object const& obj, std::string_view& value) {
+    if (obj.type != msgpack::type::STR)
+        return false;
+    value = std::string_view(obj.via.str.ptr, obj.via.str.size);
+    return true;
+}
+
+bool decode(msgpack::object const& obj, QColor& value) {
+    if (obj.type == msgpack::type::POSITIVE_INTEGER) {
+        uint64_t rgb = obj.via.u64;
+        value = QColor((rgb >> 16) & 0xff,
+                       (rgb >> 8) & 0xff,
+                       (rgb) & 0xff);
+        return true;
+    }
+    return obj.type == msgpack::type::NEGATIVE_INTEGER
+        || obj.type == msgpack::type::NIL;
+}
+
+bool decode(msgpack::object const& obj, msgpack::object& value) {
+    value = obj;
+    return true;
+}
+
+bool decode(msgpack::object const& obj, MsgpackArrayView& value) {
+    if (obj.type != msgpack::type::ARRAY)
+        return false;
+    value = MsgpackArrayView(obj.via.array);
+    return true;
+}
+
+bool decode(msgpack::object const& obj, MsgpackMapView& value) {
+    if (obj.type != msgpack::type::MAP)
+        return false;
+    value = MsgpackMapView(obj.via.map);
+    return true;
+}
+
+}
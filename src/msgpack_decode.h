@@ -0,0 +1,71 @@
+#pragma once
+
+#include <QColor>
+
+#include <cstdint>
+#include <string_view>
+
+#include <msgpack.hpp>
+
+// Views into msgpack objects; nothing is copied out until a value is decoded.
+
+class MsgpackArrayView {
+public:
+    MsgpackArrayView() = default;
+    explicit MsgpackArrayView(msgpack::object_array const& array): array_(array) {}
+
+    uint32_t size() const { return array_.size; }
+    msgpack::object const& operator[](uint32_t i) const { return array_.ptr[i]; }
+    msgpack::object const* begin() const { return array_.ptr; }
+    msgpack::object const* end() const { return array_.ptr + array_.size; }
+
+private:
+    msgpack::object_array array_ = {0, nullptr};
+};
+
+class MsgpackMapView {
+public:
+    MsgpackMapView() = default;
+    explicit MsgpackMapView(msgpack::object_map const& map): map_(map) {}
+
+    uint32_t size() const { return map_.size; }
+
+    // fn(std::string_view key, msgpack::object const& value) for every string key
+    template <typename Fn>
+    void for_each(Fn&& fn) const;
+
+    // nullptr if missing
+    msgpack::object const* find(std::string_view key) const;
+
+private:
+    msgpack::object_map map_ = {0, nullptr};
+};
+
+// Non-throwing, non-allocating decoding. Returns false on a type mismatch,
+// leaving `value` untouched, so callers can count it and keep going.
+namespace msgpack_decode {
+
+bool decode(msgpack::object const& obj, int& value);
+bool decode(msgpack::object const& obj, int64_t& value);
+bool decode(msgpack::object const& obj, bool& value);
+// floats, or integers
+bool decode(msgpack::object const& obj, double& value);
+// the view points into the object's zone (or the receive buffer)
+bool decode(msgpack::object const& obj, std::string_view& value);
+// nvim colors are 24-bit rgb; -1 or nil mean "not set" and keep the color invalid
+bool decode(msgpack::object const& obj, QColor& value);
+bool decode(msgpack::object const& obj, msgpack::object& value);
+bool decode(msgpack::object const& obj, MsgpackArrayView& value);
+bool decode(msgpack::object const& obj, MsgpackMapView& value);
+
+}
+
+
+template <typename Fn>
+void MsgpackMapView::for_each(Fn&& fn) const {
+    for (uint32_t i = 0 ; i < map_.size ; i += 1) {
+        auto const& kv = map_.ptr[i];
+        if (kv.key.type == msgpack::type::STR)
+            fn(std::string_view(kv.key.via.str.ptr, kv.key.via.str.size), kv.val);
+    }
+}
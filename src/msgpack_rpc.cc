@@ -1,9 +1,33 @@
 #include "./msgpack_rpc.h"
+#include "./tracer.h"
 
 #include <cassert>
 #include <QtDebug>
+#include <QMutexLocker>
 
 #include <iostream>
+#include <sstream>
+
+
+// flush right away instead of at the end of the event loop turn once this much is buffered
+#define WRITE_FLUSH_BYTES (64 * 1024)
+#define TIMEOUT_CHECK_INTERVAL_MS 50
+// initial (and usual) size of each receive buffer chunk; large enough for a
+// full-screen redraw on a big grid, so that rarely needs a fresh chunk
+#define READ_BUFFER_INITIAL_SIZE (256 * 1024)
+// minimum free space to read into
+#define READ_CHUNK_SIZE (32 * 1024)
+// drop an oversized receive buffer after being idle for this long
+#define READ_IDLE_SHRINK_MS 2000
+
+namespace {
+    // keep strings (grid_line texts, mostly) as views into the receive buffer
+    bool msgpack_reference_func(msgpack::type::object_type type, std::size_t, void*) {
+        return type == msgpack::type::STR
+            || type == msgpack::type::BIN
+            || type == msgpack::type::EXT;
+    }
+}
 
 
 class QIODeviceWrapper {
@@ -19,46 +43,273 @@ public:
 
 
 MsgpackRpc::MsgpackRpc(std::unique_ptr<QIODevice> iodevice):
-iodevice_(std::move(iodevice)) {
-    iodevice_->open(QIODevice::ReadWrite);
+iodevice_(std::move(iodevice)),
+unpacker_(&msgpack_reference_func, nullptr, READ_BUFFER_INITIAL_SIZE),
+read_idle_timer_(this),
+timeout_timer_(this) {
+    // sockets are opened by connecting them, reopening would drop what they buffered
+    if (!iodevice_->isOpen())
+        iodevice_->open(QIODevice::ReadWrite);
 
     connect(iodevice_.get(), &QIODevice::readyRead,
             this, &MsgpackRpc::do_read);
     connect(iodevice_.get(), &QIODevice::aboutToClose,
-            this, &MsgpackRpc::on_close);
+            this, &MsgpackRpc::handle_close);
+    connect(&timeout_timer_, &QTimer::timeout,
+            this, &MsgpackRpc::check_timeouts);
+
+    read_idle_timer_.setSingleShot(true);
+    read_idle_timer_.setInterval(READ_IDLE_SHRINK_MS);
+    connect(&read_idle_timer_, &QTimer::timeout,
+            this, &MsgpackRpc::shrink_read_buffer);
 }
 
 bool MsgpackRpc::is_open() {
     return iodevice_->isOpen();
 }
 
+std::vector<std::pair<std::string, LatencyHistogram::Summary>> MsgpackRpc::latency_summary() {
+    QMutexLocker locker(&mutex_);
+
+    std::vector<std::pair<std::string, LatencyHistogram::Summary>> ret;
+    for (auto const& it: latencies_)
+        ret.emplace_back(it.first, it.second.summary());
+    return ret;
+}
+
+std::string MsgpackRpc::describe(msgpack::object const& obj) {
+    std::ostringstream ss;
+    ss << obj;
+    return ss.str();
+}
+
+void MsgpackRpc::check_timeouts() {
+    auto now = std::chrono::steady_clock::now();
+    std::vector<callback_t> expired;
+
+    {
+        QMutexLocker locker(&mutex_);
+        bool has_deadline = false;
+        for (auto it = callbacks_.begin() ; it != callbacks_.end() ;) {
+            if (it->second.deadline <= now) {
+                qWarning() << "Msgpack request timed out" << it->first << it->second.method.c_str();
+                expired.push_back(std::move(it->second.callback));
+                it = callbacks_.erase(it);
+            } else {
+                has_deadline |= it->second.deadline != std::chrono::steady_clock::time_point::max();
+                ++it;
+            }
+        }
+
+        if (!has_deadline) {
+            timeout_timer_.stop();
+            timeout_timer_armed_ = false;
+        }
+    }
+
+    for (auto const& callback: expired)
+        if (callback)
+            callback(RESULT_TIMEOUT, msgpack::object());
+}
+
+void MsgpackRpc::handle_close() {
+    decltype(callbacks_) pending;
+    {
+        // together with the swap: call_internal tests closed_ under the same
+        // lock, so no request can be registered after the swap
+        QMutexLocker locker(&mutex_);
+        closed_ = true;
+        std::swap(pending, callbacks_);
+    }
+    for (auto const& it: pending)
+        if (it.second.callback)
+            it.second.callback(RESULT_CLOSED, msgpack::object());
+
+    emit on_close();
+}
+
+bool MsgpackRpc::start_capture(QString const& path) {
+    if (!capture_.open(path))
+        return false;
+    qDebug() << "Capturing rpc stream to" << path;
+    return true;
+}
+
+void MsgpackRpc::move_to_thread(QThread* thread) {
+    // the iodevice is not our child, so it has to be moved explicitly
+    iodevice_->moveToThread(thread);
+    this->moveToThread(thread);
+}
+
+template <typename T>
+bool MsgpackRpc::append_message(T const& body) {
+    msgpack::pack(write_buffer_, body);
+
+    if (write_buffer_.size() >= WRITE_FLUSH_BYTES
+        && QThread::currentThread() == this->thread())
+        return true;
+
+    if (!flush_scheduled_) {
+        flush_scheduled_ = true;
+        QMetaObject::invokeMethod(this, [this]() { this->flush(); },
+                                  Qt::QueuedConnection);
+    }
+    return false;
+}
+
+void MsgpackRpc::flush() {
+    {
+        QMutexLocker locker(&mutex_);
+        flush_scheduled_ = false;
+        std::swap(write_buffer_, flushing_buffer_);
+    }
+
+    if (flushing_buffer_.size() > 0) {
+        capture_.append(rpc_capture::TO_NVIM, flushing_buffer_.data(), flushing_buffer_.size());
+        capture_.flush();
+
+        QIODeviceWrapper iodevice_wrapper(this->iodevice_.get());
+        iodevice_wrapper.write(flushing_buffer_.data(), flushing_buffer_.size());
+        flushing_buffer_.clear();
+    }
+}
 
 int MsgpackRpc::call_internal(std::string const& method, msgpack::object const& params,
-                              callback_t callback) {
-    QIODeviceWrapper iodevice_wrapper(this->iodevice_.get());
+                              callback_t callback, int timeout_ms) {
+    auto now = std::chrono::steady_clock::now();
+    bool flush_now = false;
+
+    {
+        QMutexLocker locker(&mutex_);
+        if (closed_)
+            return RESULT_CLOSED;
+
+        uint32_t id = counter_++;
+
+        qDebug() << "Sending msgpack request" << id << method.c_str();
+        msgpack::type::tuple<int, uint32_t, std::string, msgpack::object>
+            request_body(0, id, method, params);
+
+        // register before the request can possibly be answered on the rpc thread
+        PendingRequest& pending = callbacks_[id];
+        pending.callback = std::move(callback);
+        pending.method = method;
+        pending.sent_at = now;
+        pending.deadline = std::chrono::steady_clock::time_point::max();
+
+        if (timeout_ms > 0) {
+            pending.deadline = now + std::chrono::milliseconds(timeout_ms);
+            if (!timeout_timer_armed_) {
+                timeout_timer_armed_ = true;
+                QMetaObject::invokeMethod(this, [this]() { timeout_timer_.start(TIMEOUT_CHECK_INTERVAL_MS); },
+                                          Qt::QueuedConnection);
+            }
+        }
+
+        flush_now = this->append_message(request_body);
+    }
+
+    // without the lock: flush() takes it
+    if (flush_now)
+        this->flush();
+    return RESULT_OK;
+}
+
+int MsgpackRpc::notify_internal(std::string const& method, msgpack::object const& params) {
+    bool flush_now = false;
+    {
+        QMutexLocker locker(&mutex_);
+        if (closed_)
+            return RESULT_CLOSED;
+
+        qDebug() << "Sending msgpack notification" << method.c_str();
+        msgpack::type::tuple<int, std::string, msgpack::object>
+            notification_body(2, method, params);
+        flush_now = this->append_message(notification_body);
+    }
+
+    if (flush_now)
+        this->flush();
+    return RESULT_OK;
+}
+
+void MsgpackRpc::handle_request(uint32_t msgid, msgpack::object const& method, msgpack::object const& params) {
+    // nvim blocks until it gets the response: always send one
+    msgpack::zone zone;
+    msgpack::object result;
+    bool ok = false;
 
-    uint32_t id = counter_++;
+    if (method.type != msgpack::type::STR) {
+        qWarning() << "Unable to convert msgpack request";
+        result = msgpack::object(std::string("invalid method"), zone);
+    } else {
+        std::string method_name(method.via.str.ptr, method.via.str.size);
+        qDebug() << "Received msgpack request" << msgid << method_name.c_str();
+        if (request_handler_)
+            ok = request_handler_(method_name, params, zone, result);
+        if (!request_handler_ || (!ok && result.is_nil()))
+            result = msgpack::object(std::string("unknown method"), zone);
+    }
+
+    msgpack::type::tuple<int, uint32_t, msgpack::object, msgpack::object>
+        response_body(1, msgid, ok ? msgpack::object() : result, ok ? result : msgpack::object());
+
+    bool flush_now = false;
+    {
+        QMutexLocker locker(&mutex_);
+        flush_now = this->append_message(response_body);
+    }
+    if (flush_now)
+        this->flush();
+}
 
-    qDebug() << "Sending msgpack request" << id << method.c_str();
-    msgpack::type::tuple<int, uint32_t, std::string, msgpack::object>
-        request_body(0, id, method, params);
-    msgpack::pack(iodevice_wrapper, request_body);
+void MsgpackRpc::shrink_read_buffer() {
+    // only between messages: a partially received one lives in the current buffer
+    if (!read_buffer_grown_ || unpacker_.nonparsed_size() > 0)
+        return;
 
-    callbacks_[id] = std::move(callback);
-    return 0;  // TODO: return error?
+    qDebug() << "Shrinking msgpack read buffer";
+    // buffers still referenced by messages are freed along with those
+    unpacker_ = msgpack::unpacker(&msgpack_reference_func, nullptr, READ_BUFFER_INITIAL_SIZE);
+    read_buffer_grown_ = false;
 }
 
 void MsgpackRpc::do_read() {
-    auto bytes_available = iodevice_->bytesAvailable();
-    assert(bytes_available > 0);
+    TRACE_SCOPE("do_read");
+
+    while (iodevice_->bytesAvailable() > 0) {
+        // read into the free tail of the current chunk. The unpacker only
+        // allocates a new one when that is too small, or when the current one
+        // is referenced by a live message and must not be moved.
+        // A new chunk also holds the unparsed start of the current message,
+        // so it outgrows the initial size along with that message.
+        if (unpacker_.buffer_capacity() < READ_CHUNK_SIZE
+            && unpacker_.nonparsed_size() + READ_CHUNK_SIZE > READ_BUFFER_INITIAL_SIZE)
+            read_buffer_grown_ = true;
+        unpacker_.reserve_buffer(READ_CHUNK_SIZE);
+
+        char* read_buffer = unpacker_.buffer();
+        auto read_ret = iodevice_->read(read_buffer, unpacker_.buffer_capacity());
+        if (read_ret <= 0)
+            break;
+        capture_.append(rpc_capture::FROM_NVIM, read_buffer, read_ret);
+        if (perf_stats_)
+            PerfStats::add(perf_stats_->bytes_read, read_ret);
+        unpacker_.buffer_consumed(read_ret);
+
+        this->parse_messages();
+    }
 
-    unpacker_.reserve_buffer(bytes_available);
-    auto read_ret = iodevice_->read(unpacker_.buffer(), bytes_available);
-    assert(read_ret == bytes_available);
-    unpacker_.buffer_consumed(read_ret);
+    capture_.flush();
+    read_idle_timer_.start();
+}
 
-    msgpack::object_handle result;
-    while (unpacker_.next(result)) {
+void MsgpackRpc::parse_messages() {
+    while (true) {
+        // fresh handle per message: a notification takes ownership of its zone
+        msgpack::object_handle result;
+        if (!unpacker_.next(result))
+            break;
         msgpack::object obj = result.get();
 
         if (obj.type != msgpack::type::ARRAY) {
@@ -81,34 +332,49 @@ void MsgpackRpc::do_read() {
             uint32_t msgid = response_body.get<1>();
             qDebug() << "Received msgpack response" << msgid;
 
-            auto callback_it = callbacks_.find(msgid);
-            if (callback_it == callbacks_.end()) {
-                qWarning() << "Unable to find callback";
-                continue;
-            }
+            callback_t callback;
+            {
+                QMutexLocker locker(&mutex_);
+                auto callback_it = callbacks_.find(msgid);
+                if (callback_it == callbacks_.end()) {
+                    // may have timed out already
+                    qWarning() << "Unable to find callback";
+                    continue;
+                }
 
-            auto callback = callback_it->second;
-            callbacks_.erase(callback_it);
+                auto const& pending = callback_it->second;
+                latencies_[pending.method].record(std::chrono::steady_clock::now() - pending.sent_at);
+
+                callback = std::move(callback_it->second.callback);
+                callbacks_.erase(callback_it);
+            }
             if (callback)
-                callback(response_body.get<2>().is_nil() ? 0 : -1,
+                callback(response_body.get<2>().is_nil() ? RESULT_OK : RESULT_ERROR,
                          response_body.get<2>().is_nil() ? response_body.get<3>() : response_body.get<2>());
         } else if (obj.via.array.size == 3 &&
             obj.via.array.ptr[0].type == msgpack::type::POSITIVE_INTEGER &&
             obj.via.array.ptr[0].via.i64 == 2) {
             // notification
-            msgpack::type::tuple<int, std::string, msgpack::object> notification_body;
-            try {
-                obj.convert(notification_body);
-            } catch (...) {
+            auto const& body = obj.via.array;
+            if (body.ptr[1].type != msgpack::type::STR) {
                 qWarning() << "Unable to convert msgpack notification";
                 continue;
             }
-            assert(notification_body.get<0>() == 2);
 
-            qDebug() << "Received msgpack notification" << notification_body.get<1>().c_str();
-            // std::cerr << notification_body.get<2>() << std::endl;
-            emit on_notification(notification_body.get<1>(),
-                                 notification_body.get<2>());
+            auto notification = std::make_shared<MsgpackNotification>();
+            notification->method.assign(body.ptr[1].via.str.ptr, body.ptr[1].via.str.size);
+            notification->params = body.ptr[2];
+            notification->handle = std::move(result);
+
+            qDebug() << "Received msgpack notification" << notification->method.c_str();
+            emit on_notification(std::move(notification));
+        } else if (obj.via.array.size == 4 &&
+            obj.via.array.ptr[0].type == msgpack::type::POSITIVE_INTEGER &&
+            obj.via.array.ptr[0].via.i64 == 0 &&
+            obj.via.array.ptr[1].type == msgpack::type::POSITIVE_INTEGER) {
+            // request
+            auto const& body = obj.via.array;
+            this->handle_request(body.ptr[1].via.u64, body.ptr[2], body.ptr[3]);
         } else {
             qWarning() << "Invalid msgpack array size" << obj.via.array.size;
         }
@@ -2,49 +2,182 @@
 
 #include <QObject>
 #include <QIODevice>
+#include <QThread>
+#include <QMutex>
+#include <QTimer>
 
+#include <atomic>
+#include <chrono>
+#include <future>
 #include <memory>
+#include <stdexcept>
 #include <utility>
 #include <functional>
 #include <unordered_map>
+#include <vector>
 
 #include <msgpack.hpp>
 
-// for single-thread only
+#include "./latency_histogram.h"
+#include "./perf_stats.h"
+#include "./rpc_capture.h"
+
+// A received msgpack-rpc notification. The object handle owns the unpacked
+// zone, and the zone holds a reference to any receive buffer chunk that the
+// objects point into, so `params` stays valid for as long as this lives.
+// Immutable once emitted: share it across threads by pointer, never copy it.
+struct MsgpackNotification {
+    std::string method;
+    msgpack::object params;
+    msgpack::object_handle handle;
+};
+
+using notification_ptr_t = std::shared_ptr<MsgpackNotification const>;
+
+Q_DECLARE_METATYPE(notification_ptr_t);
+
+// thrown by the futures returned from MsgpackRpc::request_future
+class MsgpackRpcError: public std::runtime_error {
+public:
+    MsgpackRpcError(int code, std::string const& what): std::runtime_error(what), code(code) {}
+    int const code;
+};
+
+// The iodevice is read and written on the thread this object lives in (see
+// move_to_thread). call() and notify() may be invoked from any thread;
+// callbacks and signals are run on the rpc thread.
+// Outgoing messages are buffered and written once per event loop turn of
+// the rpc thread, so a burst of input costs a single write.
 class MsgpackRpc: public QObject {
     Q_OBJECT;
 
 public:
     MsgpackRpc(std::unique_ptr<QIODevice> iodevice);
 
+    // error codes passed to callbacks
+    enum {
+        RESULT_OK = 0,
+        RESULT_ERROR = -1,  // nvim returned an error, which is passed as the object
+        RESULT_TIMEOUT = -2,
+        RESULT_CLOSED = -3,
+        RESULT_DECODE_ERROR = -4,  // typed requests only: unexpected result type
+    };
+
     // callback: (erro_code, obj)
     using callback_t = std::function<void(int, msgpack::object const&)>;
+    // Answers a request from nvim (e.g. rpcrequest(g:neoterminal_channel, ...)),
+    // on the rpc thread: fill `result` (allocated in `zone`) and return true, or
+    // fill it with the error and return false.
+    using request_handler_t = std::function<bool(std::string const& method, msgpack::object const& params,
+                                                 msgpack::zone& zone, msgpack::object& result)>;
+    // callback: (error_code, result), result is default constructed on error
+    template <typename T>
+    using result_callback_t = std::function<void(int, T)>;
+
+    // All calls return RESULT_OK, or RESULT_CLOSED without ever calling back.
+    // Any number of requests may be outstanding at once.
 
     template <typename ... Args>
     int call(std::string const& method, callback_t callback, Args const&... args);
 
+    // decode the result as T; timeout_ms <= 0 means no timeout
+    template <typename T, typename ... Args>
+    int request(std::string const& method, int timeout_ms,
+                result_callback_t<T> callback, Args const&... args);
+
+    // same as request(), but the result (or MsgpackRpcError) is delivered
+    // through a future. Never wait on it from the rpc thread.
+    template <typename T, typename ... Args>
+    std::future<T> request_future(std::string const& method, int timeout_ms,
+                                  Args const&... args);
+
     template <typename ... Args>
     int call(std::string const& method, Args const&... args);
 
+    // fire-and-forget: sent as a msgpack-rpc notification, no response is expected
+    template <typename ... Args>
+    int notify(std::string const& method, Args const&... args);
+
     bool is_open();
 
+    // per-method round trip latencies of the requests answered so far
+    std::vector<std::pair<std::string, LatencyHistogram::Summary>> latency_summary();
+
+    // move both this and the iodevice to `thread`, which then does all the
+    // reading, decoding and writing
+    void move_to_thread(QThread* thread);
+
+    // tee every byte read and written into a capture file (see rpc_capture.h).
+    // Call before any traffic, i.e. before moving to the rpc thread
+    bool start_capture(QString const& path);
+
+    // Call before moving to the rpc thread. Without a handler, every request
+    // gets an error response.
+    void set_request_handler(request_handler_t handler) { request_handler_ = std::move(handler); }
+    void set_perf_stats(PerfStats* perf_stats) { perf_stats_ = perf_stats; }
+
 signals:
-    void on_notification(std::string const& method, msgpack::object const& params);
+    void on_notification(notification_ptr_t notification);
     void on_close();
 
 private:
     std::unique_ptr<QIODevice> iodevice_;
-
-    std::unordered_map<uint32_t, callback_t> callbacks_;
+    // set under mutex_, so that no request is registered once closed
+    std::atomic<bool> closed_ = {false};
+
+    // only used on the rpc thread
+    RpcCaptureWriter capture_;
+    request_handler_t request_handler_;
+    PerfStats* perf_stats_ = nullptr;
+
+    struct PendingRequest {
+        callback_t callback;
+        std::string method;
+        std::chrono::steady_clock::time_point sent_at;
+        std::chrono::steady_clock::time_point deadline;  // max() if no timeout
+    };
+
+    // guards everything below that is touched by both callers and the rpc thread
+    QMutex mutex_;
+    std::unordered_map<uint32_t, PendingRequest> callbacks_;
+    std::unordered_map<std::string, LatencyHistogram> latencies_;
+
+    // In reference mode: STR/BIN objects point into the receive buffer
+    // chunks, which stay alive through the zones of the messages using them
     msgpack::unpacker unpacker_;
+    bool read_buffer_grown_ = false;
+    QTimer read_idle_timer_;
 
     uint32_t counter_ = 0;
 
+    // sweeps expired requests, running only while some have a deadline
+    QTimer timeout_timer_;
+    bool timeout_timer_armed_ = false;
+
+    msgpack::sbuffer write_buffer_;
+    bool flush_scheduled_ = false;
+    // swapped with write_buffer_ by flush(), so both keep their capacity
+    msgpack::sbuffer flushing_buffer_;
+
 private:
     void do_read();
+    void parse_messages();
+    void shrink_read_buffer();
+    void flush();
+    void check_timeouts();
+    void handle_close();
+    void handle_request(uint32_t msgid, msgpack::object const& method, msgpack::object const& params);
+
+    static std::string describe(msgpack::object const& obj);
+
+    // mutex_ must be held. Returns true if the caller should flush() right
+    // away, once it released mutex_; otherwise a flush is scheduled.
+    template <typename T>
+    bool append_message(T const& body);
 
     int call_internal(std::string const& method, msgpack::object const& params,
-                      callback_t callback=callback_t());
+                      callback_t callback=callback_t(), int timeout_ms=0);
+    int notify_internal(std::string const& method, msgpack::object const& params);
 
 };
 
@@ -56,7 +189,62 @@ int MsgpackRpc::call(std::string const& method, callback_t callback, Args const&
     return this->call_internal(method, msgpack::object(params, zone), callback);
 }
 
+template <typename T, typename ... Args>
+int MsgpackRpc::request(std::string const& method, int timeout_ms,
+                        result_callback_t<T> callback, Args const&... args) {
+    msgpack::zone zone;
+    msgpack::type::tuple<Args...> params(args...);
+    return this->call_internal(method, msgpack::object(params, zone),
+                               [callback](int error, msgpack::object const& obj) {
+                                   T result = T();
+                                   if (error == RESULT_OK) {
+                                       try {
+                                           obj.convert(result);
+                                       } catch (msgpack::type_error const&) {
+                                           error = RESULT_DECODE_ERROR;
+                                       }
+                                   }
+                                   if (callback)
+                                       callback(error, std::move(result));
+                               }, timeout_ms);
+}
+
+template <typename T, typename ... Args>
+std::future<T> MsgpackRpc::request_future(std::string const& method, int timeout_ms,
+                                          Args const&... args) {
+    auto promise = std::make_shared<std::promise<T>>();
+    std::future<T> future = promise->get_future();
+
+    msgpack::zone zone;
+    msgpack::type::tuple<Args...> params(args...);
+    int ret = this->call_internal(method, msgpack::object(params, zone),
+                                  [promise](int error, msgpack::object const& obj) {
+                                      if (error != RESULT_OK) {
+                                          promise->set_exception(std::make_exception_ptr(
+                                                  MsgpackRpcError(error, describe(obj))));
+                                          return;
+                                      }
+                                      try {
+                                          promise->set_value(obj.as<T>());
+                                      } catch (msgpack::type_error const&) {
+                                          promise->set_exception(std::make_exception_ptr(
+                                                  MsgpackRpcError(RESULT_DECODE_ERROR, describe(obj))));
+                                      }
+                                  }, timeout_ms);
+    if (ret != RESULT_OK)
+        promise->set_exception(std::make_exception_ptr(MsgpackRpcError(ret, "closed")));
+
+    return future;
+}
+
 template <typename ... Args>
 int MsgpackRpc::call(std::string const& method, Args const&... args) {
     return this->call(method, callback_t(), args...);
 }
+
+template <typename ... Args>
+int MsgpackRpc::notify(std::string const& method, Args const&... args) {
+    msgpack::zone zone;
+    msgpack::type::tuple<Args...> params(args...);
+    return this->notify_internal(method, msgpack::object(params, zone));
+}
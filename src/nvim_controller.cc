@@ -7,45 +7,80 @@
 #include "./msgpack_rpc.h"
 #include "./nvim_ui_calc.h"
 #include "./nvim_ui_widget.h"
+#include "./msgpack_decode.h"
+#include "./tracer.h"
 
+#define REQUEST_TIMEOUT_MS 5000
+
+
+NvimController::NvimController(std::unique_ptr<QIODevice> io, Options const& options) {
+    qRegisterMetaType<notification_ptr_t>();
 
-NvimController::NvimController(std::unique_ptr<QIODevice> io) {
     rpc_.reset(new MsgpackRpc(std::move(io)));
     ui_calc_.reset(new NvimUICalc);
     ui_widget_.reset(new NvimUIWidget);
 
+    rpc_->set_perf_stats(&perf_stats_);
+    perf_stats_.rpc = rpc_.get();
+    ui_calc_->set_perf_stats(&perf_stats_);
+    ui_widget_->setPerfStats(&perf_stats_);
+    rpc_->set_request_handler([this](std::string const& method, msgpack::object const& params,
+                                     msgpack::zone& zone, msgpack::object& result) {
+        return this->handle_request(method, params, zone, result);
+    });
+
+    // named in traces
+    rpc_thread_.setObjectName("rpc");
+    ui_calc_thread_.setObjectName("calc");
+
     ui_calc_->moveToThread(&ui_calc_thread_);
+    if (!options.capture_path.isEmpty())
+        rpc_->start_capture(options.capture_path);
+    if (options.rpc_thread)
+        rpc_->move_to_thread(&rpc_thread_);
 
+    // direct: runs on the rpc thread, so redraw batches go straight to the
+    // calc thread without a hop through the (possibly painting) GUI thread
     QObject::connect(rpc_.get(), &MsgpackRpc::on_notification,
-                     this, &NvimController::handle_notification);
+                     this, &NvimController::handle_notification,
+                     Qt::DirectConnection);
     QObject::connect(rpc_.get(), &MsgpackRpc::on_close,
                      ui_widget_.get(), &QWidget::close);
 
     QObject::connect(ui_widget_.get(), &NvimUIWidget::keyPressed,
                      [this](std::string const& vim_keycodes) {
-                         rpc_->call("nvim_input", vim_keycodes);
+                         rpc_->notify("nvim_input", vim_keycodes);
                      });
     QObject::connect(ui_widget_.get(), &NvimUIWidget::mouseInput,
                      [this](NvimUIWidget::MouseInputParams params) {
-                         rpc_->call("nvim_input_mouse",
-                                    params.button, params.action, params.modifier,
-                                    0, params.row, params.col);
+                         rpc_->notify("nvim_input_mouse",
+                                      params.button, params.action, params.modifier,
+                                      params.grid, params.row, params.col);
                      });
 
     QObject::connect(ui_widget_.get(), &NvimUIWidget::gridSizeChanged,
                      this, &NvimController::send_attach_or_resize);
 
+    ui_widget_->setFrames(ui_calc_->frames());
     QObject::connect(ui_calc_.get(), &NvimUICalc::updated,
                      ui_widget_.get(), &NvimUIWidget::updateState);
     QObject::connect(ui_calc_.get(), &NvimUICalc::fontChangeRequested,
                      ui_widget_.get(), &NvimUIWidget::setFont);
-    QObject::connect(this, &NvimController::on_notification_redraw,
-                     ui_calc_.get(), &NvimUICalc::redraw);
 
     ui_calc_thread_.start();
+    if (options.rpc_thread)
+        rpc_thread_.start();
 }
 
 NvimController::~NvimController() {
+    perf_stats_.rpc = nullptr;
+    // The rpc object, its iodevice and timers must die on the thread they live
+    // on, which has to be still running for that
+    if (rpc_thread_.isRunning())
+        QMetaObject::invokeMethod(rpc_.get(), [this]() { rpc_.reset(); },
+                                  Qt::BlockingQueuedConnection);
+    rpc_thread_.quit();
+    rpc_thread_.wait();
     ui_calc_thread_.quit();
     ui_calc_thread_.wait();
 }
@@ -55,12 +90,33 @@ void NvimController::send_attach_or_resize() {
 
     qDebug() << "Grid size" << grid_size;
     if (attached_) {
-        rpc_->call("nvim_ui_try_resize",
-                   grid_size.width(), grid_size.height());
+        rpc_->notify("nvim_ui_try_resize",
+                     grid_size.width(), grid_size.height());
     } else {
-        rpc_->call("nvim_ui_attach",
-                   grid_size.width(), grid_size.height(),
-                   std::map<std::string, bool>({{"ext_linegrid", true}}));
+        // pipelined: none of these wait for the others' responses
+        rpc_->request<msgpack::type::nil_t>(
+                "nvim_ui_attach", REQUEST_TIMEOUT_MS,
+                [](int error, msgpack::type::nil_t) {
+                    if (error != MsgpackRpc::RESULT_OK)
+                        qWarning() << "nvim_ui_attach failed" << error;
+                },
+                grid_size.width(), grid_size.height(),
+                std::map<std::string, bool>({{"ext_linegrid", true},
+                                             {"ext_multigrid", true},
+                                             {"ext_popupmenu", true},
+                                             {"ext_cmdline", true}}));
+        rpc_->request<msgpack::type::tuple<int64_t, msgpack::object>>(
+                "nvim_get_api_info", REQUEST_TIMEOUT_MS,
+                [this](int error, msgpack::type::tuple<int64_t, msgpack::object> api_info) {
+                    if (error != MsgpackRpc::RESULT_OK) {
+                        qWarning() << "nvim_get_api_info failed" << error;
+                        return;
+                    }
+                    // let scripts in nvim find us, e.g. rpcrequest(g:neoterminal_channel, ...)
+                    int64_t channel = api_info.get<0>();
+                    qDebug() << "Attached to nvim channel" << channel;
+                    rpc_->notify("nvim_set_var", std::string("neoterminal_channel"), channel);
+                });
         rpc_->call("nvim_set_client_info",
                    std::string("neoterminal"),
                    std::map<std::string, std::string>(),
@@ -71,7 +127,54 @@ void NvimController::send_attach_or_resize() {
     }
 }
 
-void NvimController::handle_notification(std::string const& method, msgpack::object const& params) {
-    if (method == "redraw")
-        emit on_notification_redraw(params);
+void NvimController::handle_notification(notification_ptr_t notification) {
+    // pass the notification itself along, so the batch keeps its zone alive
+    // until the calc thread is done with it
+    if (notification->method == "redraw")
+        ui_calc_->enqueue(std::move(notification));
+    else if (notification->method == "neoterminal_hud")  // rpcnotify(g:neoterminal_channel, 'neoterminal_hud')
+        QMetaObject::invokeMethod(ui_widget_.get(), [this]() { ui_widget_->toggleHud(); },
+                                  Qt::QueuedConnection);
+}
+
+bool NvimController::handle_request(std::string const& method, msgpack::object const& params,
+                                    msgpack::zone& zone, msgpack::object& result) {
+    // rpcrequest(g:neoterminal_channel, 'neoterminal_stats')
+    if (method == "neoterminal_stats") {
+        result = perf_stats_.to_object(zone);
+        return true;
+    }
+
+    msgpack::object arg;
+    if (params.type == msgpack::type::ARRAY && params.via.array.size > 0)
+        arg = params.via.array.ptr[0];
+
+    // rpcrequest(g:neoterminal_channel, 'neoterminal_trace', v:true)
+    if (method == "neoterminal_trace") {
+        bool enabled = true;
+        if (!arg.is_nil() && !msgpack_decode::decode(arg, enabled)) {
+            result = msgpack::object(std::string("expected a boolean"), zone);
+            return false;
+        }
+        tracer::set_enabled(enabled);
+        return true;
+    }
+
+    // rpcrequest(g:neoterminal_channel, 'neoterminal_trace_dump', '/tmp/trace.json')
+    if (method == "neoterminal_trace_dump") {
+        std::string_view path;
+        if (!msgpack_decode::decode(arg, path)) {
+            result = msgpack::object(std::string("expected a path"), zone);
+            return false;
+        }
+        int64_t nevents = tracer::dump(QString::fromUtf8(path.data(), path.size()));
+        if (nevents < 0) {
+            result = msgpack::object(std::string("unable to write the trace"), zone);
+            return false;
+        }
+        result = msgpack::object(nevents, zone);
+        return true;
+    }
+
+    return false;
 }
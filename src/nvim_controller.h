@@ -10,15 +10,29 @@
 
 #include <msgpack.hpp>
 
-class MsgpackRpc;
+#include "./msgpack_rpc.h"
+#include "./perf_stats.h"
+
 class NvimUIWidget;
 class NvimUICalc;
 
 class NvimController: public QObject {
     Q_OBJECT;
 
+public:
+    struct Options {
+        // read, decode and write the nvim pipe on its own thread instead of the GUI thread
+        bool rpc_thread = true;
+        // record the raw rpc stream to this file, if not empty
+        QString capture_path;
+    };
+
 private:
 
+    // shared by every stage, outlives them
+    PerfStats perf_stats_;
+
+    QThread rpc_thread_;
     QThread ui_calc_thread_;
     std::unique_ptr<MsgpackRpc> rpc_;
     std::unique_ptr<NvimUICalc> ui_calc_;
@@ -28,15 +42,17 @@ private:
 
 public:
     NvimUIWidget* ui_widget() { return ui_widget_.get(); }
+    NvimUICalc* ui_calc() { return ui_calc_.get(); }
 
-    NvimController(std::unique_ptr<QIODevice> io);
+    NvimController(std::unique_ptr<QIODevice> io, Options const& options);
     ~NvimController();
 
 private slots:
     void send_attach_or_resize();
-    void handle_notification(std::string const& method, msgpack::object const& params);
+    void handle_notification(notification_ptr_t notification);
 
-signals:
-    void on_notification_redraw(msgpack::object const& params);
+private:
+    bool handle_request(std::string const& method, msgpack::object const& params,
+                        msgpack::zone& zone, msgpack::object& result);
 
 };
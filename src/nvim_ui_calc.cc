@@ -2,7 +2,10 @@
 
 #include <QDebug>
 #include <QFont>
+#include <QMutexLocker>
 #include <QRegularExpression>
+#include <QRunnable>
+#include <QThread>
 
 #include <algorithm>
 #include <functional>
@@ -10,9 +13,39 @@
 #include <tuple>
 #include <type_traits>
 #include <chrono>
-#include <iostream>
+#include <cstring>
+#include <cstdlib>
+#include <cmath>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// run segmentation of a large redraw is split in chunks of at least this many
+// rows, over at most this many threads
+#define SEGMENT_CHUNK_MIN_ROWS 16
+#define SEGMENT_MAX_THREADS 4
+// highlights are stored dense by id; nvim allocates them from 1 upwards
+#define MAX_HIGHLIGHT_ID (1 << 20)
+
+// grid 1 holds the whole screen; the others (with ext_multigrid) are laid on top
+#define GLOBAL_GRID 1
+#define GLOBAL_GRID_ZINDEX -1
+#define WINDOW_ZINDEX 0
+#define FLOAT_DEFAULT_ZINDEX 50
+#define MESSAGE_ZINDEX 200
 
 namespace {
+    // FNV-1a. Being constexpr, it is evaluated at compile time for the case
+    // labels below, and a collision between two handled names would fail to
+    // compile as a duplicate case
+    constexpr uint32_t event_name_hash(const char* str, size_t size) {
+        uint32_t hash = 2166136261u;
+        for (size_t i = 0 ; i < size ; i += 1)
+            hash = (hash ^ uint8_t(str[i])) * 16777619u;
+        return hash;
+    }
+
     // haha.. magic!
 
     template <typename T>
@@ -29,61 +62,79 @@ namespace {
             using type = typename std::tuple_element<I, std::tuple<typename std::decay_t<Args>...>>::type;
         };
 
+        // Args are views or plain values (see msgpack_decode.h), so this never
+        // allocates. Missing args are left default, as newer nvim versions
+        // append args; mismatching ones are counted in `errors`.
         template <size_t I>
-        static typename arg_t<I>::type arg(msgpack::object_array const& array) {
-            typename arg_t<I>::type ret;
-            if (I < array.size)
-                ret = array.ptr[I].template as<typename arg_t<I>::type>();
-            return std::move(ret);
+        static typename arg_t<I>::type arg(msgpack::object_array const& array, uint64_t& errors) {
+            typename arg_t<I>::type ret = typename arg_t<I>::type();
+            if (I < array.size && !msgpack_decode::decode(array.ptr[I], ret))
+                errors += 1;
+            return ret;
         }
 
         template <size_t... Ids>
         static decltype(auto) call_internal(NvimUICalc* nvimui, fn_t fn, msgpack::object_array const& array,
-                                            std::index_sequence<Ids...>) {
-            return (nvimui->*fn)(arg<Ids>(array)...);
+                                            uint64_t& errors, std::index_sequence<Ids...>) {
+            return (nvimui->*fn)(arg<Ids>(array, errors)...);
         }
 
-        static decltype(auto) call(NvimUICalc* nvimui, fn_t fn, msgpack::object_array const& array) {
-            return call_internal(nvimui, fn, array,
+        static decltype(auto) call(NvimUICalc* nvimui, fn_t fn, msgpack::object_array const& array,
+                                   uint64_t& errors) {
+            return call_internal(nvimui, fn, array, errors,
                                  std::index_sequence_for<Args...>());
         }
     };
 
 }
 
-msgpack::object const& msgpack::adaptor::convert<QColor>::operator()(msgpack::object const& obj, QColor& color) const {
-    // otherwise, keep color invalid
-    if (obj.type == msgpack::type::POSITIVE_INTEGER) {
-        int64_t rgb = obj.via.i64;
-        color = QColor(
-                (rgb >> 16) & 0xff,
-                (rgb >> 8) & 0xff,
-                (rgb) & 0xff
-        );
-    }
-    return obj;
+namespace {
+    class SegmentTask: public QRunnable {
+        std::function<void()> fn_;
+    public:
+        explicit SegmentTask(std::function<void()> fn): fn_(std::move(fn)) {}
+        void run() override { fn_(); }
+    };
 }
 
-void NvimUICalc::InternalCell::reset() {
-    this->text.clear();
-    this->highlight_id = 0;
-    this->contiguous_cols = 0;
+NvimUICalc::NvimUICalc() {
+    // the calc thread itself takes one share of the work
+    segment_pool_.setMaxThreadCount(std::max(1, std::min(SEGMENT_MAX_THREADS, QThread::idealThreadCount()) - 1));
 }
 
-bool NvimUICalc::InternalCell::is_whitespace() const {
-    return this->text == " ";
-}
+void NvimUICalc::enqueue(redraw_batch_t batch) {
+    queued_batches_ += 1;
 
-bool NvimUICalc::InternalCell::is_empty() const {
-    return this->text.empty();
+    QMutexLocker locker(&pending_mutex_);
+    pending_batches_.push_back(std::move(batch));
+    // one drain call per backlog, not per batch
+    if (pending_batches_.size() == 1)
+        QMetaObject::invokeMethod(this, [this]() { this->drain_pending(); },
+                                  Qt::QueuedConnection);
 }
 
-NvimUICalc::NvimUICalc() = default;
+void NvimUICalc::drain_pending() {
+    {
+        QMutexLocker locker(&pending_mutex_);
+        std::swap(pending_batches_, draining_batches_);
+    }
+
+    if (draining_batches_.size() > 1)
+        qDebug() << "Applying" << draining_batches_.size() << "redraw batches back to back";
+
+    for (auto& batch: draining_batches_) {
+        this->redraw(std::move(batch));
+        queued_batches_ -= 1;
+    }
+    draining_batches_.clear();
+}
 
-void NvimUICalc::redraw(msgpack::object const& params) {
+void NvimUICalc::redraw(redraw_batch_t batch) {
+    msgpack::object const& params = batch->params;
     assert(params.type == msgpack::type::ARRAY);
 
     auto t0 = std::chrono::steady_clock::now();
+    TRACE_SCOPE_FRAME("redraw", frame_id_);
 
     for (int i = 0 ; i < params.via.array.size ; i += 1) {
         msgpack::object const* obj = params.via.array.ptr + i;
@@ -98,59 +149,193 @@ void NvimUICalc::redraw(msgpack::object const& params) {
 
         bool handled = false;
 
-#define TRY_HANDLE(NAME) do { \
-    if (strncmp(name.ptr, #NAME, name.size) == 0) { \
-        handled = true; \
-        for (int j = 1 ; j < objarray.size ; j += 1) { \
-            assert(objarray.ptr[j].type == msgpack::type::ARRAY); \
-            nvim_ui_handle_helper<decltype(&NvimUICalc::handle_ ## NAME)>::call( \
-                this, &NvimUICalc::handle_ ## NAME, objarray.ptr[j].via.array); \
-        } \
-    } \
-} while (0)
-
-        TRY_HANDLE(grid_resize);
-        TRY_HANDLE(default_colors_set);
-        TRY_HANDLE(hl_attr_define);
-        TRY_HANDLE(grid_line);
-        TRY_HANDLE(grid_clear);
-        TRY_HANDLE(grid_scroll);
-        TRY_HANDLE(flush);
-        TRY_HANDLE(mode_info_set);
-        TRY_HANDLE(mode_change);
-        TRY_HANDLE(grid_cursor_goto);
-        TRY_HANDLE(busy_start);
-        TRY_HANDLE(busy_stop);
-        TRY_HANDLE(option_set);
-
-#undef TRY_HANDLE
-
-        if (!handled) {
-            qWarning() << "Ignore draw event " << QString(QByteArray(name.ptr, name.size));
-            std::cerr << *obj << std::endl;
+        switch (event_name_hash(name.ptr, name.size)) {
+#define HANDLE_EVENT(NAME) \
+            case event_name_hash(#NAME, sizeof(#NAME) - 1): \
+                if (name.size == sizeof(#NAME) - 1 && memcmp(name.ptr, #NAME, name.size) == 0) { \
+                    TRACE_SCOPE_FRAME("handle_" #NAME, frame_id_); \
+                    handled = true; \
+                    event_counts_[size_t(Event::NAME)] += objarray.size - 1; \
+                    for (int j = 1 ; j < objarray.size ; j += 1) { \
+                        assert(objarray.ptr[j].type == msgpack::type::ARRAY); \
+                        nvim_ui_handle_helper<decltype(&NvimUICalc::handle_ ## NAME)>::call( \
+                            this, &NvimUICalc::handle_ ## NAME, objarray.ptr[j].via.array, \
+                            decode_errors_); \
+                    } \
+                } \
+                break;
+
+            NVIM_UI_EVENTS(HANDLE_EVENT)
+
+#undef HANDLE_EVENT
         }
+
+        if (!handled)
+            this->count_unhandled_event(name);
+    }
+
+    if (perf_stats_) {
+        PerfStats::add(perf_stats_->redraw_batches, 1);
+        perf_stats_->calc_time.record(std::chrono::steady_clock::now() - t0);
+    }
+}
+
+void NvimUICalc::publish_perf_stats() {
+    static const char* const EVENT_NAMES[] = {
+#define EVENT_NAME(NAME) #NAME,
+        NVIM_UI_EVENTS(EVENT_NAME)
+#undef EVENT_NAME
+    };
+
+    event_count_list_.clear();
+    for (size_t i = 0 ; i < size_t(Event::COUNT) ; i += 1)
+        event_count_list_.emplace_back(EVENT_NAMES[i], event_counts_[i]);
+    for (auto const& it: unhandled_events_)
+        event_count_list_.emplace_back(it.first.c_str(), it.second);
+    perf_stats_->set_redraw_events(event_count_list_);
+
+    perf_stats_->decode_errors.store(decode_errors_, std::memory_order_relaxed);
+    perf_stats_->frames_skipped.store(frames_.skipped(), std::memory_order_relaxed);
+}
+
+void NvimUICalc::count_unhandled_event(msgpack::object_str const& name) {
+    auto it = unhandled_events_.try_emplace(std::string(name.ptr, name.size), 0).first;
+    if (it->second == 0)
+        qDebug() << "Ignore draw event" << it->first.c_str();
+    it->second += 1;
+}
+
+NvimUICalc::Grid* NvimUICalc::find_grid(int id) {
+    auto it = grids_.find(id);
+    if (it == grids_.end()) {
+        qWarning() << "Redraw event for unknown grid" << id;
+        decode_errors_ += 1;
+        return nullptr;
     }
+    return it->second.get();
+}
 
-    auto t1 = std::chrono::steady_clock::now();
-    qDebug() << "Parsing redraw event costs" << std::chrono::duration_cast<std::chrono::microseconds>(t1-t0).count() << "us";
+NvimUICalc::Grid* NvimUICalc::find_or_create_grid(int id) {
+    auto& grid = grids_[id];
+    if (!grid) {
+        grid.reset(new Grid);
+        grid->id = id;
+        // the global grid is always shown, below everything
+        if (id == GLOBAL_GRID)
+            this->place_grid(grid.get(), true, QPoint(0, 0), GLOBAL_GRID_ZINDEX);
+    }
+    return grid.get();
 }
 
-void NvimUICalc::handle_grid_resize(int grid, int width, int height) {
-    assert(grid == 1);
+void NvimUICalc::place_grid(Grid* grid, bool visible, QPoint pos, int zindex) {
+    if (grid->visible)
+        dirty_cells_.mark(grid->rect());
 
-    qDebug() << "handle_grid_resize" << width << height;
+    grid->visible = visible;
+    grid->pos = pos;
+    grid->zindex = zindex;
+    grid->placement_seq = ++placement_seq_;
+    z_order_changed_ = true;
 
-    width_ = width;
-    height_ = height;
+    if (grid->visible)
+        dirty_cells_.mark(grid->rect());
+}
 
-    cells_.resize(height_);
-    for (int i = 0 ; i < height ; i += 1) {
-        cells_[i].resize(width_);
-        for (auto& cell: cells_[i])
-            cell.reset();
+void NvimUICalc::mark_cells_dirty(Grid const* grid, QRect const& rect) {
+    if (grid->visible)
+        dirty_cells_.mark(rect.translated(grid->pos));
+}
+
+void NvimUICalc::handle_grid_resize(int grid_id, int width, int height) {
+    qDebug() << "handle_grid_resize" << grid_id << width << height;
+
+    if (width < 0 || height < 0) {
+        decode_errors_ += 1;
+        return;
     }
 
-    dirty_cells_ |= QRect(0, 0, width, height);
+    Grid* grid = this->find_or_create_grid(grid_id);
+    this->mark_cells_dirty(grid, QRect(0, 0, grid->width(), grid->height()));
+
+    grid->cells.resize(width, height);
+    if (ascii_run_.size() < size_t(width))
+        ascii_run_.resize(width);
+
+    grid->snapshot_rows.assign(height, nullptr);
+    grid->dirty_rows.assign(height, 1);
+    grid->pending_segments.assign(height, NO_SEGMENT);
+
+    this->mark_cells_dirty(grid, QRect(0, 0, width, height));
+}
+
+void NvimUICalc::handle_grid_destroy(int grid_id) {
+    qDebug() << "handle_grid_destroy" << grid_id;
+
+    Grid* grid = this->find_grid(grid_id);
+    if (!grid || grid_id == GLOBAL_GRID)
+        return;
+    if (grid->visible)
+        this->place_grid(grid, false);
+    grids_.erase(grid_id);
+}
+
+void NvimUICalc::handle_win_pos(int grid_id, msgpack::object const&,
+                                int start_row, int start_col, int, int) {
+    qDebug() << "handle_win_pos" << grid_id << start_row << start_col;
+
+    Grid* grid = this->find_or_create_grid(grid_id);
+    this->place_grid(grid, true, QPoint(start_col, start_row), WINDOW_ZINDEX);
+}
+
+void NvimUICalc::handle_win_float_pos(int grid_id, msgpack::object const&,
+                                      std::string_view anchor, int anchor_grid_id,
+                                      double anchor_row, double anchor_col,
+                                      bool, int zindex) {
+    qDebug() << "handle_win_float_pos" << grid_id << QByteArray::fromRawData(anchor.data(), anchor.size())
+        << anchor_grid_id << anchor_row << anchor_col << zindex;
+
+    Grid* grid = this->find_or_create_grid(grid_id);
+    Grid* anchor_grid = this->find_grid(anchor_grid_id);
+    if (!anchor_grid)
+        return;
+
+    // anchor is the corner of the float at (anchor_row, anchor_col) of anchor_grid
+    double row = anchor_row, col = anchor_col;
+    if (anchor.size() == 2 && anchor[0] == 'S')
+        row -= grid->height();
+    if (anchor.size() == 2 && anchor[1] == 'E')
+        col -= grid->width();
+    QPoint pos = anchor_grid->pos + QPoint(std::lround(col), std::lround(row));
+
+    // zindex only comes with nvim 0.5
+    this->place_grid(grid, true, pos, zindex > 0 ? zindex : FLOAT_DEFAULT_ZINDEX);
+}
+
+void NvimUICalc::handle_win_external_pos(int grid_id, msgpack::object const&) {
+    // no external windows here: keep it out of the way
+    qDebug() << "handle_win_external_pos" << grid_id;
+    this->handle_win_hide(grid_id);
+}
+
+void NvimUICalc::handle_win_hide(int grid_id) {
+    qDebug() << "handle_win_hide" << grid_id;
+
+    Grid* grid = this->find_grid(grid_id);
+    if (grid && grid->visible)
+        this->place_grid(grid, false, grid->pos, grid->zindex);
+}
+
+void NvimUICalc::handle_win_close(int grid_id) {
+    qDebug() << "handle_win_close" << grid_id;
+    // the grid itself goes with grid_destroy
+    this->handle_win_hide(grid_id);
+}
+
+void NvimUICalc::handle_msg_set_pos(int grid_id, int row, bool, std::string_view) {
+    qDebug() << "handle_msg_set_pos" << grid_id << row;
+
+    Grid* grid = this->find_or_create_grid(grid_id);
+    this->place_grid(grid, true, QPoint(0, row), MESSAGE_ZINDEX);
 }
 
 void NvimUICalc::handle_default_colors_set(QColor const& fg,
@@ -161,30 +346,115 @@ void NvimUICalc::handle_default_colors_set(QColor const& fg,
     default_foreground_ = fg;
     default_background_ = bg;
     default_special_ = sp;
+    highlights_changed_ = true;
 
-    dirty_cells_ |= QRect(0, 0, width_, height_);
     dirty_defaults_ = true;
 }
 
-void NvimUICalc::handle_hl_attr_define(highlight_id_t id, Highlight attr) {
-    qDebug() << "handle_hl_attr_define" << id;
+void NvimUICalc::handle_hl_attr_define(highlight_id_t id, MsgpackMapView rgb_attr) {
+    if (id <= 0 || id > MAX_HIGHLIGHT_ID) {
+        decode_errors_ += 1;
+        return;
+    }
+    if (size_t(id) >= highlight_defs_.size())
+        highlight_defs_.resize(id + 1);
+    Highlight* highlight = &highlight_defs_[id];
+    *highlight = Highlight();
+    highlights_changed_ = true;
+
+    rgb_attr.for_each([this, highlight](std::string_view key, msgpack::object const& value) {
+        bool ok = true;
+        if (key == "foreground")
+            ok = msgpack_decode::decode(value, highlight->foreground);
+        else if (key == "background")
+            ok = msgpack_decode::decode(value, highlight->background);
+        else if (key == "special")
+            ok = msgpack_decode::decode(value, highlight->special);
+        else if (key == "reverse")
+            ok = msgpack_decode::decode(value, highlight->reverse);
+        else if (key == "italic")
+            ok = msgpack_decode::decode(value, highlight->italic);
+        else if (key == "bold")
+            ok = msgpack_decode::decode(value, highlight->bold);
+        else if (key == "strikethrough")
+            ok = msgpack_decode::decode(value, highlight->strikethrough);
+        else if (key == "underline")
+            ok = msgpack_decode::decode(value, highlight->underline);
+        else if (key == "undercurl")
+            ok = msgpack_decode::decode(value, highlight->undercurl);
+        else if (key == "blend")
+            ok = msgpack_decode::decode(value, highlight->blend);
+        if (!ok)
+            decode_errors_ += 1;
+    });
+}
 
-    highlights_[id] = std::shared_ptr<Highlight>(new Highlight(attr));
+namespace {
+    // dst[i] = src[i]
+    void widen_ascii(uint8_t const* src, uint32_t* dst, int size) {
+        int i = 0;
+#ifdef __SSE2__
+        __m128i const zero = _mm_setzero_si128();
+        for ( ; i + 16 <= size ; i += 16) {
+            __m128i bytes = _mm_loadu_si128(reinterpret_cast<__m128i const*>(src + i));
+            __m128i lo = _mm_unpacklo_epi8(bytes, zero);
+            __m128i hi = _mm_unpackhi_epi8(bytes, zero);
+            __m128i* out = reinterpret_cast<__m128i*>(dst + i);
+            _mm_storeu_si128(out + 0, _mm_unpacklo_epi16(lo, zero));
+            _mm_storeu_si128(out + 1, _mm_unpackhi_epi16(lo, zero));
+            _mm_storeu_si128(out + 2, _mm_unpacklo_epi16(hi, zero));
+            _mm_storeu_si128(out + 3, _mm_unpackhi_epi16(hi, zero));
+        }
+#endif
+        for ( ; i < size ; i += 1)
+            dst[i] = src[i];
+    }
 }
 
-void NvimUICalc::handle_grid_line(int grid, int row, int col_start, msgpack::object const& data) {
-    assert(grid == 1);
-    assert(row >= 0 && row < height_);
-    assert(col_start >= 0 && col_start < width_);
-    qDebug() << "handle_grid_line" << grid << row << col_start;
+void NvimUICalc::handle_grid_line(int grid_id, int row, int col_start, msgpack::object const& data) {
+    Grid* grid = this->find_grid(grid_id);
+    if (!grid)
+        return;
+    int width = grid->width();
+    assert(row >= 0 && row < grid->height());
+    assert(col_start >= 0 && col_start < width);
 
-    auto& cells_row = this->cells_[row];
+    NvimUIGrid::glyph_id_t* glyphs_row = grid->cells.glyph_row(row);
+    highlight_id_t* highlights_row = grid->cells.highlight_row(row);
 
-    highlight_id_t last_highlight_id;
+    highlight_id_t last_highlight_id = 0;
     int col = col_start;
 
     assert(data.type == msgpack::type::ARRAY);
-    for (int i = 0 ; i < data.via.array.size ; i += 1) {
+    uint32_t size = data.via.array.size;
+    for (uint32_t i = 0 ; i < size ; i += 1) {
+        // Fast path: a run of single ASCII byte cells without repeat count,
+        // by far the most common. Their glyph ids are the bytes themselves,
+        // collected here and widened into the row at once.
+        int run_col = col;
+        while (i < size && col < width) {
+            msgpack::object const& elem = data.via.array.ptr[i];
+            if (elem.type != msgpack::type::ARRAY
+                || elem.via.array.size < 1 || elem.via.array.size > 2)
+                break;
+            msgpack::object const& text = elem.via.array.ptr[0];
+            if (text.type != msgpack::type::STR || text.via.str.size != 1
+                || uint8_t(text.via.str.ptr[0]) >= GlyphTable::ASCII_END)
+                break;
+            if (elem.via.array.size == 2) {
+                if (elem.via.array.ptr[1].type != msgpack::type::POSITIVE_INTEGER)
+                    break;
+                last_highlight_id = elem.via.array.ptr[1].via.u64;
+            }
+            ascii_run_[col - run_col] = uint8_t(text.via.str.ptr[0]);
+            highlights_row[col] = last_highlight_id;
+            col += 1;
+            i += 1;
+        }
+        widen_ascii(ascii_run_.data(), glyphs_row + run_col, col - run_col);
+        if (i == size)
+            break;
+
         msgpack::object const& elem = data.via.array.ptr[i];
         assert(elem.type == msgpack::type::ARRAY);
         assert(elem.via.array.size >= 1);
@@ -204,227 +474,628 @@ void NvimUICalc::handle_grid_line(int grid, int row, int col_start, msgpack::obj
             repeat = elem.via.array.ptr[2].via.i64;
         }
 
+        auto glyph = glyphs_.intern(std::string_view(text.via.str.ptr, text.via.str.size));
         for (int j = 0 ; j < repeat ; j += 1) {
-            assert(col < width_);
+            assert(col < width);
 
-            InternalCell& cell = cells_row[col];
-            cell.text = std::string(text.via.str.ptr, text.via.str.size);
-            cell.highlight_id = last_highlight_id;
+            glyphs_row[col] = glyph;
+            highlights_row[col] = last_highlight_id;
 
             col += 1;
         }
     }
 
-    this->refresh_contiguous_text(row, col_start, col);
+    this->queue_segmentation(grid, row, col_start, col);
+}
+
+void NvimUICalc::queue_segmentation(Grid* grid, int row, int start, int end) {
+    assert(end >= start);
+    assert(row >= 0 && row < grid->height());
+    // merged with the (possibly empty, at scroll edges) range queued before
+    auto& pending = grid->pending_segments[row];
+    pending.first = std::min(pending.first, start);
+    pending.second = std::max(pending.second, end);
+}
+
+void NvimUICalc::queue_cursor_segmentation() {
+    // runs are split at the cursor, and its cell repainted
+    auto it = grids_.find(cursor_grid_);
+    if (it == grids_.end())
+        return;
+    Grid* grid = it->second.get();
+    if (cursor_.x() >= 0 && cursor_.y() >= 0 && cursor_.x() < grid->width() && cursor_.y() < grid->height())
+        this->queue_segmentation(grid, cursor_.y(), cursor_.x(), cursor_.x() + 1);
 }
 
-void NvimUICalc::refresh_contiguous_text(int row, int start, int end) {
+std::pair<int, int> NvimUICalc::segment_row(Grid* grid, int row, int start, int end, QString& scratch) {
     assert(end >= start);
-    assert(row >= 0 && row < height_);
-    auto& cells_row = this->cells_[row];
+    assert(row >= 0 && row < grid->height());
+    int width = grid->width();
+    auto const* glyphs = grid->cells.glyph_row(row);
+    auto const* highlights = grid->cells.highlight_row(row);
+    int* contiguous_cols = grid->cells.run_cols_row(row);
+    QString* contiguous_texts = grid->cells.run_text_row(row);
+
+    QPoint cursor = (!busy_ && grid->id == cursor_grid_) ? cursor_ : QPoint(-1, -1);
 
     // expand to all non-whitelist cells
-    while (start > 0 && !cells_row[start-1].is_whitespace())
+    while (start > 0 && glyphs[start-1] != GlyphTable::SPACE)
         start -= 1;
-    while (end < width_ && !cells_row[end].is_whitespace())
+    while (end < width && glyphs[end] != GlyphTable::SPACE)
         end += 1;
 
     int x_start = start;
-    if (x_start < width_ && cells_row[x_start].contiguous_cols < 0)
-        x_start += cells_row[x_start].contiguous_cols;
+    if (x_start < width && contiguous_cols[x_start] < 0)
+        x_start += contiguous_cols[x_start];
 
     int x_end = end;
-    if (x_end < width_ && cells_row[x_end].contiguous_cols < 0) {
-        x_end += cells_row[x_end].contiguous_cols;
+    if (x_end < width && contiguous_cols[x_end] < 0) {
+        x_end += contiguous_cols[x_end];
         assert(x_end >= 0);
-        assert(cells_row[x_end].contiguous_cols > 0);
-        x_end += cells_row[x_end].contiguous_cols;
+        assert(contiguous_cols[x_end] > 0);
+        x_end += contiguous_cols[x_end];
         assert(x_end > end);
     }
 
     if (!(x_start < x_end))
-        return;
-
-    dirty_cells_ |= QRect(x_start, row, x_end - x_start, 1);
+        return std::make_pair(0, 0);
 
     int anchor_x = x_start;
-    std::string contiguous_utf8;
+    scratch.resize(0);  // keeps the capacity
     for (int x = x_start ; x <= x_end ; x += 1) {   // <= x_end
         if (x == x_end
-            || cells_row[x].is_whitespace()
-            || cells_row[anchor_x].is_whitespace()
-            || (x > 0 && cells_row[x-1].is_empty())
-            || QPoint(x, row) == cursor_
-            || (QPoint(anchor_x, row) == cursor_ && !cells_row[x].is_empty())  // double width
-            || cells_row[x].highlight_id != cells_row[anchor_x].highlight_id) {
+            || glyphs[x] == GlyphTable::SPACE
+            || glyphs[anchor_x] == GlyphTable::SPACE
+            || (x > 0 && glyphs[x-1] == GlyphTable::EMPTY)
+            || QPoint(x, row) == cursor
+            || (QPoint(anchor_x, row) == cursor && glyphs[x] != GlyphTable::EMPTY)  // double width
+            || highlights[x] != highlights[anchor_x]) {
             // if it's whitelist, keep contiguous_cols = 0
-            if (!cells_row[anchor_x].is_whitespace() && !cells_row[anchor_x].is_empty()) {
-                cells_row[anchor_x].contiguous_text = QString::fromUtf8(contiguous_utf8.data(), contiguous_utf8.size());
-                cells_row[anchor_x].contiguous_cols = x - anchor_x;
+            if (glyphs[anchor_x] != GlyphTable::SPACE && glyphs[anchor_x] != GlyphTable::EMPTY) {
+                // deep copy, so that the scratch buffer stays unshared
+                if (contiguous_texts[anchor_x] != scratch)
+                    contiguous_texts[anchor_x] = QString(scratch.constData(), scratch.size());
+                contiguous_cols[anchor_x] = x - anchor_x;
             }
 
             anchor_x = x;
-            contiguous_utf8.clear();
+            scratch.resize(0);
         }
 
         if (x < x_end) {
-            cells_row[x].contiguous_cols = anchor_x - x;  // negative
-            contiguous_utf8 += cells_row[x].text;
+            contiguous_cols[x] = anchor_x - x;  // negative
+            glyphs_.append_to(glyphs[x], scratch);
         }
     }
+    return std::make_pair(x_start, x_end);
 }
 
-void NvimUICalc::handle_grid_clear(int grid) {
-    assert(grid == 1);
+void NvimUICalc::handle_grid_clear(int grid_id) {
+    qDebug() << "handle_grid_clear" << grid_id;
 
-    qDebug() << "handle_grid_clear";
+    Grid* grid = this->find_grid(grid_id);
+    if (!grid)
+        return;
 
-    for (auto& row: cells_)
-        for (auto& cell: row)
-            cell.reset();
+    grid->cells.clear();
 
-    dirty_cells_ |= QRect(0, 0, width_, height_);
+    std::fill(grid->dirty_rows.begin(), grid->dirty_rows.end(), 1);
+    std::fill(grid->pending_segments.begin(), grid->pending_segments.end(), NO_SEGMENT);
+    this->mark_cells_dirty(grid, QRect(0, 0, grid->width(), grid->height()));
 }
 
-void NvimUICalc::handle_grid_scroll(int grid, int top, int bot, int left, int right, int rows, int cols) {
-    assert(grid == 1);
+void NvimUICalc::handle_grid_scroll(int grid_id, int top, int bot, int left, int right, int rows, int cols) {
     assert(cols == 0);
     assert(rows != 0);
 
-    qDebug() << "handle_grid_scroll" << top << bot << left << right << rows << cols;
+    qDebug() << "handle_grid_scroll" << grid_id << top << bot << left << right << rows << cols;
 
-    dirty_cells_ |= QRect(left, top, right-left, bot-top);
+    Grid* grid = this->find_grid(grid_id);
+    if (!grid)
+        return;
+    int width = grid->width();
+    assert(top >= 0 && bot <= grid->height() && left >= 0 && right <= width);
+
+    this->mark_cells_dirty(grid, QRect(left, top, right-left, bot-top));
+
+    auto& dirty_rows = grid->dirty_rows;
+    auto& pending_segments = grid->pending_segments;
+
+    // Region [top, bot) x [left, right) moves up by `rows` (down if negative),
+    // the rows it leaves are cleared until nvim redraws them
+    if (left == 0 && right == width) {
+        grid->cells.scroll_rows(top, bot, rows);
+        // moved rows keep their snapshot rows and pending segmentation,
+        // only the cleared ones are rebuilt
+        int vacated_top = rows > 0 ? std::max(top, bot - rows) : top;
+        int vacated_bot = rows > 0 ? bot : std::min(bot, top - rows);
+        if (std::abs(rows) < bot - top) {
+            auto rotate_rows = [top, bot, rows](auto& per_row) {
+                auto begin = per_row.begin() + top, end = per_row.begin() + bot;
+                std::rotate(begin, rows > 0 ? begin + rows : end + rows, end);
+            };
+            rotate_rows(grid->snapshot_rows);
+            rotate_rows(dirty_rows);
+            rotate_rows(pending_segments);
+        }
+        std::fill(dirty_rows.begin() + vacated_top, dirty_rows.begin() + vacated_bot, 1);
+        std::fill(pending_segments.begin() + vacated_top, pending_segments.begin() + vacated_bot,
+                  NO_SEGMENT);
+    } else if (rows > 0) {
+        std::fill(dirty_rows.begin() + top, dirty_rows.begin() + bot, 1);
+        for (int y = top + rows ; y < bot ; y += 1)
+            this->copy_region_row(grid, y - rows, y, left, right);
+        for (int y = std::max(top, bot - rows) ; y < bot ; y += 1)
+            grid->cells.clear_cells(y, left, right);
+    } else {
+        std::fill(dirty_rows.begin() + top, dirty_rows.begin() + bot, 1);
+        for (int y = bot - 1 + rows ; y >= top ; y -= 1)
+            this->copy_region_row(grid, y - rows, y, left, right);
+        for (int y = top ; y < std::min(bot, top - rows) ; y += 1)
+            grid->cells.clear_cells(y, left, right);
+    }
 
-    if (rows > 0) {
-        for (int y = top ; y < bot ; y += 1) {
-            int dst_y = y - rows;
-            if (dst_y < 0)
-                continue;
-            for (int x = left ; x < right ; x += 1) {
-                assert(x >= 0 && x < width_);
-                assert(y >= 0 && y < height_);
-                cells_[dst_y][x] = cells_[y][x];
-                cells_[y][x].reset();
-            }
+    for (int y = top ; y < bot ; y += 1) {
+        if (left > 0)
+            this->queue_segmentation(grid, y, left, left);
+        if (right < width)
+            this->queue_segmentation(grid, y, right, right);
+    }
+}
+
+void NvimUICalc::copy_region_row(Grid* grid, int dst_row, int src_row, int left, int right) {
+    grid->cells.copy_cells(dst_row, src_row, left, right);
+    // the part of the source's pending segmentation that moved along
+    auto const& src_pending = grid->pending_segments[src_row];
+    int start = std::max(left, src_pending.first), end = std::min(right, src_pending.second);
+    if (start <= end)
+        this->queue_segmentation(grid, dst_row, start, end);
+}
+
+void NvimUICalc::segment_pending_rows() {
+    segment_rows_.clear();
+    for (auto const& it: grids_) {
+        Grid* grid = it.second.get();
+        for (int y = 0 ; y < grid->height() ; y += 1)
+            if (grid->pending_segments[y].first <= grid->pending_segments[y].second)
+                segment_rows_.emplace_back(grid, y);
+    }
+    segment_spans_.resize(segment_rows_.size());
+
+    auto segment_range = [this](size_t begin, size_t end, QString& scratch) {
+        TRACE_SCOPE_FRAME("segment_rows", frame_id_);
+        for (size_t i = begin ; i < end ; i += 1) {
+            Grid* grid = segment_rows_[i].first;
+            int y = segment_rows_[i].second;
+            auto const& pending = grid->pending_segments[y];
+            segment_spans_[i] = this->segment_row(grid, y, pending.first, pending.second, scratch);
         }
+    };
+
+    // Rows are independent: a full redraw is split over the pool, this thread
+    // taking the first chunk. Small updates are not worth the handoff.
+    size_t nchunks = std::min<size_t>(segment_pool_.maxThreadCount() + 1,
+                                      segment_rows_.size() / SEGMENT_CHUNK_MIN_ROWS);
+    if (nchunks <= 1) {
+        segment_range(0, segment_rows_.size(), contiguous_text_);
     } else {
-        for (int y = bot - 1 ; y >= top ; y -= 1) {
-            int dst_y = y - rows;
-            if (dst_y >= bot)
-                continue;
-            for (int x = left ; x < right ; x += 1) {
-                assert(x >= 0 && x < width_);
-                assert(y >= 0 && y < height_);
-                cells_[dst_y][x] = cells_[y][x];
-                cells_[y][x].reset();
-            }
+        size_t chunk_size = (segment_rows_.size() + nchunks - 1) / nchunks;
+        for (size_t begin = chunk_size ; begin < segment_rows_.size() ; begin += chunk_size) {
+            size_t end = std::min(begin + chunk_size, segment_rows_.size());
+            segment_pool_.start(new SegmentTask([segment_range, begin, end]() {
+                QString scratch;
+                segment_range(begin, end, scratch);
+            }));
         }
+        segment_range(0, chunk_size, contiguous_text_);
+        segment_pool_.waitForDone();
     }
 
-    for (int y = std::min(top, top - rows) ; y < std::max(bot, bot - rows) ; y += 1) {
-        if (y < 0 || y >= height_)
-            continue;
-        if (left > 0)
-            this->refresh_contiguous_text(y, left, left);
-        if (right < width_)
-            this->refresh_contiguous_text(y, right, right);
+    for (size_t i = 0 ; i < segment_rows_.size() ; i += 1) {
+        Grid* grid = segment_rows_[i].first;
+        int y = segment_rows_[i].second;
+        auto span = segment_spans_[i];
+        if (span.first < span.second) {
+            this->mark_cells_dirty(grid, QRect(span.first, y, span.second - span.first, 1));
+            grid->dirty_rows[y] = 1;
+        }
+        grid->pending_segments[y] = NO_SEGMENT;
     }
 }
 
 void NvimUICalc::handle_flush() {
+    // A later batch is already waiting and will end with its own flush, so
+    // this snapshot would never be shown. Keep dirty_cells_ for that one.
+    // (nvim splits a large update over several batches, flushing only after the last)
+    if (queued_batches_ > 1) {
+        qDebug() << "handle_flush: coalesced";
+        if (perf_stats_)
+            PerfStats::add(perf_stats_->flushes_coalesced, 1);
+        return;
+    }
+
     qDebug() << "handle_flush";
+    auto t0 = std::chrono::steady_clock::now();
+    TRACE_SCOPE_FRAME("handle_flush", frame_id_);
+
+    this->segment_pending_rows();
+
+    if (z_order_changed_) {
+        z_order_.clear();
+        for (auto const& it: grids_)
+            if (it.second->visible)
+                z_order_.push_back(it.second.get());
+        std::sort(z_order_.begin(), z_order_.end(), [](Grid const* a, Grid const* b) {
+            return std::make_pair(a->zindex, a->placement_seq) < std::make_pair(b->zindex, b->placement_seq);
+        });
+        z_order_changed_ = false;
+    }
 
-    std::shared_ptr<NvimUIState> state(new NvimUIState);
+    // refill the recycled frame: assignments reuse its buffers
+    NvimUIState* state = &frames_.back().state;
+    state->frame_id = frame_id_;
 
     state->default_background = default_background_;
     state->default_foreground = default_foreground_;
     state->default_special = default_special_;
 
+    auto global_grid = grids_.find(GLOBAL_GRID);
+    state->size = global_grid != grids_.end()
+        ? QSize(global_grid->second->width(), global_grid->second->height())
+        : QSize(0, 0);
+
+    state->cursor_grid = busy_ ? 0 : cursor_grid_;
     state->cursor = cursor_;
-    state->size = QSize(width_, height_);
-    state->modeinfo = (mode_idx_ >= 0 && mode_idx_ < modeinfos_.size()) ? modeinfos_[mode_idx_] : Modeinfo();
-
-    state->cells.resize(cells_.size());
-    for (size_t i = 0 ; i < cells_.size() ; i += 1) {
-        state->cells[i].resize(cells_[i].size());
-        for (size_t j = 0 ; j < cells_[i].size() ; j += 1) {
-            state->cells[i][j].contiguous_text = cells_[i][j].contiguous_text;
-            state->cells[i][j].contiguous_cols = cells_[i][j].contiguous_cols;
-            auto it = highlights_.find(cells_[i][j].highlight_id);
-            if (it != highlights_.end())
-                state->cells[i][j].highlight = it->second;
+    if (mode_idx_ >= 0 && mode_idx_ < modeinfos_.size())
+        state->modeinfo = modeinfos_[mode_idx_];
+    else
+        state->modeinfo = Modeinfo();
+
+    // hidden grids keep their dirty rows until shown again
+    state->grids.resize(z_order_.size());
+    for (size_t i = 0 ; i < z_order_.size() ; i += 1) {
+        Grid* grid = z_order_[i];
+        for (int y = 0 ; y < grid->height() ; y += 1) {
+            if (grid->dirty_rows[y]) {
+                grid->snapshot_rows[y] = this->build_snapshot_row(grid, y);
+                grid->dirty_rows[y] = 0;
+            }
         }
+
+        auto& state_grid = state->grids[i];
+        state_grid.id = grid->id;
+        state_grid.pos = grid->pos;
+        state_grid.size = QSize(grid->width(), grid->height());
+        state_grid.cells = grid->snapshot_rows;
     }
 
-    emit updated(state, dirty_cells_, dirty_defaults_);
+    if (highlights_changed_)
+        this->refresh_highlight_table();
+    state->highlights = highlight_table_;
+
+    // the widget diffs these with the frame it showed before
+    state->popupmenu = popupmenu_;
+    state->cmdline = cmdline_;
 
-    dirty_cells_ = QRegion(0, 0, 0, 0);
+    tracer::flow(tracer::FLOW_BEGIN, frame_id_);
+    bool notify = frames_.publish(dirty_cells_, dirty_defaults_);
+    frame_id_ += 1;
+
+    dirty_cells_.clear();
     dirty_defaults_ = false;
+
+    if (perf_stats_) {
+        PerfStats::add(perf_stats_->flushes, 1);
+        perf_stats_->flush_time.record(std::chrono::steady_clock::now() - t0);
+        this->publish_perf_stats();
+    }
+
+    if (notify)
+        emit updated();
 }
 
 
-void NvimUICalc::handle_mode_info_set(bool cursor_style_enabled,
-                                       std::vector<Modeinfo> mode_infos) {
-    qDebug() << "handle_mode_info_set";
+std::shared_ptr<NvimUIState::Row const> NvimUICalc::build_snapshot_row(Grid const* grid, int row) const {
+    auto const* highlights = grid->cells.highlight_row(row);
+    int const* contiguous_cols = grid->cells.run_cols_row(row);
+    QString const* contiguous_texts = grid->cells.run_text_row(row);
+
+    auto state_row = std::make_shared<NvimUIState::Row>(grid->width());
+    for (int j = 0 ; j < grid->width() ; j += 1) {
+        auto& cell = (*state_row)[j];
+        cell.highlight_id = highlights[j];
+        cell.contiguous_cols = contiguous_cols[j];
+        if (contiguous_cols[j] > 0)
+            cell.contiguous_text = contiguous_texts[j];
+    }
+    return state_row;
+}
 
-    if (!cursor_style_enabled)
+void NvimUICalc::refresh_highlight_table() {
+    // published frames may still hold the current table
+    if (!highlight_table_ || highlight_table_.use_count() > 1) {
+        uint64_t version = highlight_table_ ? highlight_table_->version : 0;
+        highlight_table_ = std::make_shared<NvimUIState::HighlightTable>();
+        highlight_table_->version = version;
+    }
+    highlight_table_->version += 1;
+
+    auto& highlights = highlight_table_->highlights;
+    highlights.resize(std::max<size_t>(1, highlight_defs_.size()));
+    for (size_t id = 0 ; id < highlights.size() ; id += 1) {
+        Highlight& highlight = highlights[id];
+        highlight = id < highlight_defs_.size() ? highlight_defs_[id] : Highlight();
+
+        if (!highlight.foreground.isValid())
+            highlight.foreground = default_foreground_;
+        if (!highlight.background.isValid())
+            highlight.background = default_background_;
+        if (!highlight.special.isValid())
+            highlight.special = default_special_.isValid() ? default_special_ : highlight.foreground;
+        if (highlight.reverse)
+            std::swap(highlight.foreground, highlight.background);
+    }
+
+    highlights_changed_ = false;
+}
+
+void NvimUICalc::handle_mode_info_set(bool cursor_style_enabled,
+                                       MsgpackArrayView mode_infos) {
+    if (!cursor_style_enabled) {
         modeinfos_.clear();
-    else
-        modeinfos_ = std::move(mode_infos);
+        this->queue_cursor_segmentation();
+        return;
+    }
+
+    // parse into the existing entries, reusing their strings
+    modeinfos_.resize(mode_infos.size());
+    for (uint32_t i = 0 ; i < mode_infos.size() ; i += 1) {
+        Modeinfo& modeinfo = modeinfos_[i];
+        modeinfo.cursor_shape = Modeinfo::BLOCK;
+        modeinfo.cell_percentage = 100;
+        modeinfo.short_name.clear();
+        modeinfo.name.clear();
+
+        MsgpackMapView attrs;
+        if (!msgpack_decode::decode(mode_infos[i], attrs)) {
+            decode_errors_ += 1;
+            continue;
+        }
+
+        attrs.for_each([this, &modeinfo](std::string_view key, msgpack::object const& value) {
+            bool ok = true;
+            std::string_view str;
+            if (key == "cursor_shape") {
+                ok = msgpack_decode::decode(value, str);
+                if (str == "horizontal")
+                    modeinfo.cursor_shape = Modeinfo::HORIZONTAL;
+                else if (str == "vertical")
+                    modeinfo.cursor_shape = Modeinfo::VERTICAL;
+            } else if (key == "cell_percentage") {
+                ok = msgpack_decode::decode(value, modeinfo.cell_percentage);
+            } else if (key == "short_name") {
+                ok = msgpack_decode::decode(value, str);
+                modeinfo.short_name.assign(str.data(), str.size());
+            } else if (key == "name") {
+                ok = msgpack_decode::decode(value, str);
+                modeinfo.name.assign(str.data(), str.size());
+            }
+            if (!ok)
+                decode_errors_ += 1;
+        });
+    }
 
-    this->refresh_cursor(cursor_);
+    this->queue_cursor_segmentation();
 }
 
-void NvimUICalc::handle_mode_change(std::string const& mode, int mode_idx) {
-    qDebug() << "handle_mode_change" << mode.c_str() << mode_idx;
+void NvimUICalc::handle_mode_change(std::string_view mode, int mode_idx) {
+    qDebug() << "handle_mode_change" << QByteArray::fromRawData(mode.data(), mode.size()) << mode_idx;
 
-    mode_ = mode;
+    mode_.assign(mode.data(), mode.size());
     mode_idx_ = mode_idx;
 
-    this->refresh_cursor(cursor_);
+    this->queue_cursor_segmentation();
 }
 
 void NvimUICalc::handle_grid_cursor_goto(int grid, int row, int col) {
-    assert(grid == 1);
-    qDebug() << "handle_grid_cursor_goto" << row << col;
+    qDebug() << "handle_grid_cursor_goto" << grid << row << col;
 
-    if (cursor_saved_on_busy_.x() >= 0 && cursor_saved_on_busy_.y() >= 0)
-        cursor_saved_on_busy_ = QPoint(col, row);
-    else
-        this->refresh_cursor(QPoint(col, row));
+    this->queue_cursor_segmentation();
+    cursor_grid_ = grid;
+    cursor_ = QPoint(col, row);
+    this->queue_cursor_segmentation();
 }
 
 void NvimUICalc::handle_busy_start() {
     qDebug() << "handle_busy_start";
 
-    cursor_saved_on_busy_ = cursor_;
-    this->refresh_cursor(QPoint(-1, -1));
+    busy_ = true;
+    this->queue_cursor_segmentation();
 }
 
 void NvimUICalc::handle_busy_stop() {
-    qDebug() << "handle_busy_stop" << cursor_saved_on_busy_;
+    qDebug() << "handle_busy_stop";
+
+    busy_ = false;
+    this->queue_cursor_segmentation();
+}
+
+void NvimUICalc::handle_hl_group_set(std::string_view name, highlight_id_t id) {
+    if (name == "Pmenu")
+        popupmenu_.highlight_id = id;
+    else if (name == "PmenuSel")
+        popupmenu_.selected_highlight_id = id;
+}
+
+void NvimUICalc::handle_popupmenu_show(MsgpackArrayView items, int selected,
+                                       int row, int col, int grid_id) {
+    qDebug() << "handle_popupmenu_show" << items.size() << selected << row << col << grid_id;
+
+    auto new_items = std::make_shared<NvimUIState::Popupmenu::Items>();
+    new_items->lines.reserve(items.size());
+    for (uint32_t i = 0 ; i < items.size() ; i += 1) {
+        // [word, kind, menu, info]
+        MsgpackArrayView item;
+        if (!msgpack_decode::decode(items[i], item)) {
+            decode_errors_ += 1;
+            continue;
+        }
+        std::array<QString, 3> line;
+        for (uint32_t j = 0 ; j < std::min<uint32_t>(3, item.size()) ; j += 1) {
+            std::string_view str;
+            if (!msgpack_decode::decode(item[j], str)) {
+                decode_errors_ += 1;
+                continue;
+            }
+            line[j] = QString::fromUtf8(str.data(), str.size());
+            new_items->column_widths[j] = std::max(new_items->column_widths[j], GlyphTable::cell_width(line[j]));
+        }
+        new_items->lines.push_back(std::move(line));
+    }
+    // columns aligned across items, like nvim's own popupmenu
+    for (int column_width: new_items->column_widths) {
+        if (column_width == 0)
+            continue;
+        if (new_items->width > 0)
+            new_items->width += 1;
+        new_items->width += column_width;
+    }
+
+    popupmenu_.items = std::move(new_items);
+    popupmenu_.selected = selected;
+    // grid -1: the menu completes the cmdline (wildmenu)
+    QPoint grid_pos(0, 0);
+    auto it = grids_.find(grid_id);
+    if (grid_id == -1) {
+        auto global_grid = grids_.find(GLOBAL_GRID);
+        if (global_grid != grids_.end())
+            grid_pos = QPoint(0, global_grid->second->height() - 1);
+        row = 0;
+    } else if (it != grids_.end()) {
+        grid_pos = it->second->pos;
+    }
+    popupmenu_.anchor = grid_pos + QPoint(col, row);
+}
+
+void NvimUICalc::handle_popupmenu_select(int selected) {
+    popupmenu_.selected = selected;
+}
 
-    this->refresh_cursor(cursor_saved_on_busy_);
-    cursor_saved_on_busy_ = QPoint(-1, -1);
+void NvimUICalc::handle_popupmenu_hide() {
+    qDebug() << "handle_popupmenu_hide";
+    popupmenu_.items.reset();
+    popupmenu_.selected = -1;
 }
 
-void NvimUICalc::refresh_cursor(QPoint new_pos) {
-    QPoint old_pos = cursor_;
-    cursor_ = new_pos;
+void NvimUICalc::handle_cmdline_show(MsgpackArrayView content, int pos,
+                                     std::string_view firstc, std::string_view prompt,
+                                     int indent, int level) {
+    qDebug() << "handle_cmdline_show" << content.size() << pos << level;
+
+    cmdline_content_.resize(content.size());
+    for (uint32_t i = 0 ; i < content.size() ; i += 1) {
+        // [attrs, text]; attrs is a highlight id, or a dict in older nvim
+        MsgpackArrayView chunk;
+        std::string_view text;
+        int highlight_id = 0;
+        if (!msgpack_decode::decode(content[i], chunk) || chunk.size() < 2
+            || !msgpack_decode::decode(chunk[1], text)) {
+            decode_errors_ += 1;
+            cmdline_content_[i].second.clear();
+            continue;
+        }
+        msgpack_decode::decode(chunk[0], highlight_id);
+        cmdline_content_[i].first = highlight_id;
+        cmdline_content_[i].second.assign(text.data(), text.size());
+    }
 
-    if (old_pos != new_pos && old_pos.x() >= 0 && old_pos.y() >= 0 && old_pos.x() < width_ && old_pos.y() < height_)
-        this->refresh_contiguous_text(old_pos.y(), old_pos.x(), old_pos.x() + 1);
+    cmdline_prefix_.assign(firstc.data(), firstc.size());
+    cmdline_prefix_.append(prompt.data(), prompt.size());
+    cmdline_prefix_.append(std::max(0, indent), ' ');
+    cmdline_pos_ = pos;
+    cmdline_special_char_.clear();
+    cmdline_level_ = level;
+
+    cmdline_.visible = true;
+    this->refresh_cmdline();
+}
+
+void NvimUICalc::handle_cmdline_pos(int pos, int level) {
+    if (level != cmdline_level_)
+        return;
+    cmdline_pos_ = pos;
+    cmdline_special_char_.clear();
+    this->refresh_cmdline();
+}
 
-    if (new_pos.x() >= 0 && new_pos.y() >= 0 && new_pos.x() < width_ && new_pos.y() < height_)
-        this->refresh_contiguous_text(new_pos.y(), new_pos.x(), new_pos.x() + 1);
+void NvimUICalc::handle_cmdline_special_char(std::string_view c, bool shift, int level) {
+    if (level != cmdline_level_)
+        return;
+    cmdline_special_char_.assign(c.data(), c.size());
+    cmdline_special_shift_ = shift;
+    this->refresh_cmdline();
+}
+
+void NvimUICalc::handle_cmdline_hide(int level) {
+    qDebug() << "handle_cmdline_hide" << level;
+    // a nested cmdline (e.g. <C-r>=) ends: the outer one is shown again by nvim
+    cmdline_.visible = false;
+    cmdline_.chunks.clear();
+    cmdline_content_.clear();
+}
+
+void NvimUICalc::refresh_cmdline() {
+    cmdline_.chunks.clear();
+    QString prefix = QString::fromStdString(cmdline_prefix_);
+    cmdline_.cursor = GlyphTable::cell_width(prefix);
+    if (!prefix.isEmpty())
+        cmdline_.chunks.emplace_back(0, std::move(prefix));
+
+    // The special char (e.g. ^V, waiting for the next key) is shown at the
+    // cursor, which stays on it. With shift, the text after the cursor makes
+    // room for it; otherwise it covers the char under the cursor, which may
+    // be the first one of a later chunk.
+    bool overwrite_pending = false;
+    auto overwrite_char = [](QString& text, int pos) {
+        if (pos >= text.size())
+            return false;
+        text.remove(pos, text.at(pos).isHighSurrogate() ? 2 : 1);
+        return true;
+    };
+
+    // the cursor is a byte offset in the content, shown as a cell offset
+    int bytes = 0;
+    bool cursor_found = false;
+    for (auto const& chunk: cmdline_content_) {
+        QString text = QString::fromStdString(chunk.second);
+        if (overwrite_pending)
+            overwrite_pending = !overwrite_char(text, 0);
+
+        int cursor_in_chunk = cmdline_pos_ - bytes;
+        if (!cursor_found && cursor_in_chunk <= int(chunk.second.size())) {
+            QString before_cursor = QString::fromUtf8(chunk.second.data(), std::max(0, cursor_in_chunk));
+            int cursor_chars = before_cursor.size();
+            cmdline_.cursor += GlyphTable::cell_width(before_cursor);
+            if (!cmdline_special_char_.empty()) {
+                if (!cmdline_special_shift_)
+                    overwrite_pending = !overwrite_char(text, cursor_chars);
+                text.insert(cursor_chars, QString::fromStdString(cmdline_special_char_));
+            }
+            cursor_found = true;
+        } else if (!cursor_found) {
+            cmdline_.cursor += GlyphTable::cell_width(text);
+        }
+        bytes += chunk.second.size();
+        cmdline_.chunks.emplace_back(chunk.first, std::move(text));
+    }
 }
 
 namespace {
     const QRegularExpression FONT_REGEX("^([\\w\\s]+),?(\\d*)$");
 }
 
-void NvimUICalc::handle_option_set(std::string const& name, msgpack::object const& value) {
-    qDebug() << "handle_option_set" << name.c_str();
+void NvimUICalc::handle_option_set(std::string_view name, msgpack::object const& value) {
+    qDebug() << "handle_option_set" << QByteArray::fromRawData(name.data(), name.size());
 
     if (name == "guifont" && value.type == msgpack::type::STR) {
         QString value_str = QString::fromUtf8(value.via.str.ptr, value.via.str.size);
@@ -4,63 +4,198 @@
 #include <QColor>
 #include <QSize>
 #include <QRect>
-#include <QRegion>
+#include <QMutex>
+#include <QThreadPool>
 
+#include <array>
+#include <atomic>
+#include <climits>
+#include <memory>
+#include <string>
+#include <string_view>
 #include <unordered_map>
 #include <vector>
 
 #include <msgpack.hpp>
+#include "./msgpack_rpc.h"
+#include "./msgpack_decode.h"
+#include "./dirty_spans.h"
 #include "./nvim_ui_state.h"
+#include "./nvim_ui_grid.h"
+#include "./nvim_ui_frame_mailbox.h"
+#include "./perf_stats.h"
+#include "./tracer.h"
+
+// All handled redraw events: handle_<NAME> is called for each of them.
+// Dispatch is a single switch generated from this list, so adding events does
+// not slow down the others.
+#define NVIM_UI_EVENTS(X) \
+    X(grid_resize) \
+    X(default_colors_set) \
+    X(hl_attr_define) \
+    X(grid_line) \
+    X(grid_clear) \
+    X(grid_scroll) \
+    X(flush) \
+    X(mode_info_set) \
+    X(mode_change) \
+    X(grid_cursor_goto) \
+    X(busy_start) \
+    X(busy_stop) \
+    X(option_set) \
+    X(grid_destroy) \
+    X(win_pos) \
+    X(win_float_pos) \
+    X(win_external_pos) \
+    X(win_hide) \
+    X(win_close) \
+    X(msg_set_pos) \
+    X(hl_group_set) \
+    X(popupmenu_show) \
+    X(popupmenu_select) \
+    X(popupmenu_hide) \
+    X(cmdline_show) \
+    X(cmdline_pos) \
+    X(cmdline_special_char) \
+    X(cmdline_hide)
 
 class NvimUICalc : public QObject {
     Q_OBJECT;
 
 public:
-    using highlight_id_t = int;
+    using highlight_id_t = NvimUIGrid::highlight_id_t;
 
     using Highlight = NvimUIState::Highlight;
     using Modeinfo = NvimUIState::Modeinfo;
 
+    enum class Event {
+#define DECLARE_EVENT(NAME) NAME,
+        NVIM_UI_EVENTS(DECLARE_EVENT)
+#undef DECLARE_EVENT
+        COUNT
+    };
+
 private:
+    // calls per handled event, and per unhandled event name. Keyed by the
+    // name itself, not its hash, so that colliding names stay apart; it is
+    // only touched on the unhandled path.
+    std::array<uint64_t, size_t(Event::COUNT)> event_counts_ = {};
+    std::unordered_map<std::string, uint64_t> unhandled_events_;
+    // event arguments of unexpected types (which are then left default)
+    uint64_t decode_errors_ = 0;
+
     QColor default_foreground_;
     QColor default_background_;
     QColor default_special_;
 
-    std::unordered_map<highlight_id_t, std::shared_ptr<Highlight>> highlights_;
+    // as defined by nvim (colors may be invalid: use the defaults), dense by id
+    std::vector<Highlight> highlight_defs_;
+    // resolved for the snapshots, rebuilt on flush after any change
+    std::shared_ptr<NvimUIState::HighlightTable> highlight_table_;
+    bool highlights_changed_ = true;
+
+    // Run segmentation is deferred to the flush: [first, second) of each row
+    // are the columns changed since, NO_SEGMENT if none
+    static constexpr std::pair<int, int> NO_SEGMENT = {INT_MAX, INT_MIN};
 
-    struct InternalCell {
-        std::string text;
-        highlight_id_t highlight_id = 0;
+    // One of nvim's grids, kept, segmented and snapshotted on its own
+    struct Grid {
+        int id = 0;
+        NvimUIGrid cells;
+        std::vector<std::pair<int, int>> pending_segments;
+        // rows of the last snapshot, and the rows changed since then
+        std::vector<std::shared_ptr<NvimUIState::Row const>> snapshot_rows;
+        std::vector<uint8_t> dirty_rows;
 
-        QString contiguous_text;
-        int contiguous_cols = 0;  // if negative: the start cols
+        // placement on the global grid
+        bool visible = false;
+        QPoint pos;
+        int zindex = 0;
+        // at equal zindex, the grid placed last is on top
+        uint64_t placement_seq = 0;
 
-        void reset();
-        bool is_empty() const;
-        bool is_whitespace() const;
+        int width() const { return cells.width(); }
+        int height() const { return cells.height(); }
+        QRect rect() const { return QRect(pos, QSize(cells.width(), cells.height())); }
     };
 
-    std::vector<std::vector<InternalCell>> cells_;
-    QRegion dirty_cells_;
+    GlyphTable glyphs_;
+    std::unordered_map<int, std::unique_ptr<Grid>> grids_;
+    // visible grids, bottom first
+    std::vector<Grid*> z_order_;
+    bool z_order_changed_ = false;
+    uint64_t placement_seq_ = 0;
+
+    // scratch buffer of handle_grid_line, one byte per column
+    std::vector<uint8_t> ascii_run_;
+    // scratch buffers of segment_pending_rows: (grid, row), and the result
+    std::vector<std::pair<Grid*, int>> segment_rows_;
+    std::vector<std::pair<int, int>> segment_spans_;
+    QString contiguous_text_;
+    QThreadPool segment_pool_;
+
+    // in cells of the global grid
+    DirtySpans dirty_cells_;
     bool dirty_defaults_ = false;
 
-    int width_ = 0, height_ = 0;
+    NvimUIFrameMailbox frames_;
+    // of the frame the batches being applied end up in
+    uint64_t frame_id_ = 1;
+
+    // ext_popupmenu / ext_cmdline, as published
+    NvimUIState::Popupmenu popupmenu_;
+    NvimUIState::Cmdline cmdline_;
+    // cmdline_show content, kept to redo the line for cmdline_pos / cmdline_special_char
+    std::vector<std::pair<int, std::string>> cmdline_content_;
+    std::string cmdline_prefix_;
+    int cmdline_pos_ = 0;  // bytes in the content
+    std::string cmdline_special_char_;
+    bool cmdline_special_shift_ = false;
+    int cmdline_level_ = 0;
 
     // modes & cursors
     std::string mode_;
     int mode_idx_ = -1;
     std::vector<Modeinfo> modeinfos_;
+    int cursor_grid_ = 0;
     QPoint cursor_ = QPoint(-1, -1);
-    QPoint cursor_saved_on_busy_ = QPoint(-1, -1);
+    // the cursor is hidden while busy
+    bool busy_ = false;
+
+    // batches queued by enqueue(), drained on our thread
+    QMutex pending_mutex_;
+    std::vector<notification_ptr_t> pending_batches_;
+    std::vector<notification_ptr_t> draining_batches_;
+    // queued or being applied; read by handle_flush to skip snapshots
+    std::atomic<int> queued_batches_ = {0};
+
+    PerfStats* perf_stats_ = nullptr;
+    // scratch buffer of publish_perf_stats
+    std::vector<std::pair<char const*, uint64_t>> event_count_list_;
 
 public:
     NvimUICalc();
 
-    void redraw(msgpack::object const& params);
+    // a redraw batch owns the unpacked params it carries
+    using redraw_batch_t = notification_ptr_t;
+
+    // Thread-safe. Queue a batch to be applied on our thread. Batches that
+    // pile up while we are busy are applied back to back, and only the last
+    // flush among them emits a snapshot (with the dirty region of all).
+    void enqueue(redraw_batch_t batch);
+
+    // apply a batch right away, on the calling thread
+    void redraw(redraw_batch_t batch);
+
+    // each flush publishes a frame here, for the widget to take
+    NvimUIFrameMailbox* frames() { return &frames_; }
+
+    // call before the first batch
+    void set_perf_stats(PerfStats* perf_stats) { perf_stats_ = perf_stats; }
 
 signals:
-    void updated(std::shared_ptr<NvimUIState> state,
-                 QRegion dirty_cells, bool defaults_updated);
+    // new frames in frames(): emitted once until the consumer takes one
+    void updated();
     void fontChangeRequested(QFont font);
 
 private:
@@ -69,23 +204,66 @@ private:
                                    QColor const& rgb_bg,
                                    QColor const& rgb_sp);
     void handle_hl_attr_define(highlight_id_t id,
-                               Highlight rgb_attr);
+                               MsgpackMapView rgb_attr);
     void handle_grid_line(int grid, int row, int col_start,
                           msgpack::object const& data);
     void handle_grid_clear(int grid);
     void handle_grid_scroll(int grid, int top, int bot, int left, int right, int rows, int cols);
     void handle_flush();
+    // copy what is only counted on our thread into perf_stats_
+    void publish_perf_stats();
 
     void handle_mode_info_set(bool cursor_style_enabled,
-                              std::vector<Modeinfo> mode_infos);
-    void handle_mode_change(std::string const& mode, int mode_idx);
+                              MsgpackArrayView mode_infos);
+    void handle_mode_change(std::string_view mode, int mode_idx);
     void handle_grid_cursor_goto(int grid, int row, int col);
-    void handle_option_set(std::string const& name, msgpack::object const& value);
+    void handle_option_set(std::string_view name, msgpack::object const& value);
 
     void handle_busy_start();
     void handle_busy_stop();
 
+    void handle_grid_destroy(int grid);
+    void handle_win_pos(int grid, msgpack::object const& win,
+                        int start_row, int start_col, int width, int height);
+    void handle_win_float_pos(int grid, msgpack::object const& win,
+                              std::string_view anchor, int anchor_grid,
+                              double anchor_row, double anchor_col,
+                              bool focusable, int zindex);
+    void handle_win_external_pos(int grid, msgpack::object const& win);
+    void handle_win_hide(int grid);
+    void handle_win_close(int grid);
+    void handle_msg_set_pos(int grid, int row, bool scrolled, std::string_view sep_char);
+
+    void handle_hl_group_set(std::string_view name, highlight_id_t id);
+    void handle_popupmenu_show(MsgpackArrayView items, int selected, int row, int col, int grid);
+    void handle_popupmenu_select(int selected);
+    void handle_popupmenu_hide();
+    void handle_cmdline_show(MsgpackArrayView content, int pos,
+                             std::string_view firstc, std::string_view prompt,
+                             int indent, int level);
+    void handle_cmdline_pos(int pos, int level);
+    void handle_cmdline_special_char(std::string_view c, bool shift, int level);
+    void handle_cmdline_hide(int level);
+
 private:
-    void refresh_contiguous_text(int row, int start, int end);
-    void refresh_cursor(QPoint new_pos);
+    void drain_pending();
+    void count_unhandled_event(msgpack::object_str const& name);
+
+    // the grid, or nullptr (counted as a decode error) if nvim never sized it
+    Grid* find_grid(int id);
+    Grid* find_or_create_grid(int id);
+    void place_grid(Grid* grid, bool visible, QPoint pos = QPoint(), int zindex = 0);
+    void mark_cells_dirty(Grid const* grid, QRect const& rect);
+
+    void queue_segmentation(Grid* grid, int row, int start, int end);
+    void queue_cursor_segmentation();
+    void segment_pending_rows();
+    // Rebuild the runs of a row around [start, end) (expanded to whole words
+    // and runs), returning the columns rebuilt. Only touches this row, so rows
+    // may be segmented concurrently.
+    std::pair<int, int> segment_row(Grid* grid, int row, int start, int end, QString& scratch);
+    void copy_region_row(Grid* grid, int dst_row, int src_row, int left, int right);
+    void refresh_highlight_table();
+    void refresh_cmdline();
+    std::shared_ptr<NvimUIState::Row const> build_snapshot_row(Grid const* grid, int row) const;
 };
@@ -0,0 +1,43 @@
+#include "./nvim_ui_frame_mailbox.h"
+
+NvimUIFrameMailbox::NvimUIFrameMailbox():
+middle_(1), back_(0), front_(2) {}
+
+bool NvimUIFrameMailbox::publish(DirtySpans const& dirty_cells, bool defaults_updated) {
+    // The frame carries every change since the last frame taken. Until we
+    // learn that one was taken, keep accumulating.
+    acc_dirty_cells_.merge(dirty_cells);
+    acc_defaults_updated_ |= defaults_updated;
+
+    Frame& frame = frames_[back_];
+    frame.dirty_cells = acc_dirty_cells_;
+    frame.defaults_updated = acc_defaults_updated_;
+
+    uint8_t old_middle = middle_.exchange(back_ | FRESH, std::memory_order_acq_rel);
+    back_ = old_middle & INDEX_MASK;
+
+    if (old_middle & FRESH) {
+        skipped_ += 1;
+    } else {
+        // the consumer took the previous frame: from now on only this one is
+        // pending (its dirty region may be larger than needed, which is fine)
+        acc_dirty_cells_.clear();
+        acc_dirty_cells_.merge(dirty_cells);
+        acc_defaults_updated_ = defaults_updated;
+    }
+
+    return !notify_pending_.exchange(true, std::memory_order_acq_rel);
+}
+
+bool NvimUIFrameMailbox::take() {
+    // before looking at the middle frame, so that a later publish notifies again
+    notify_pending_.store(false, std::memory_order_release);
+
+    if (!(middle_.load(std::memory_order_acquire) & FRESH))
+        return false;
+
+    uint8_t old_middle = middle_.exchange(front_, std::memory_order_acq_rel);
+    front_ = old_middle & INDEX_MASK;
+    has_front_ = true;
+    return true;
+}
@@ -0,0 +1,60 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+
+#include "./dirty_spans.h"
+#include "./nvim_ui_state.h"
+
+// Lock-free triple buffer carrying NvimUIState frames from NvimUICalc
+// (producer) to NvimUIWidget (consumer).
+// The producer fills back() and publish()es it; the consumer take()s the
+// newest published frame into front(). Frames published in between are
+// skipped, their dirty regions merged into the next one. The three frames
+// are recycled forever, so their buffers are reused.
+class NvimUIFrameMailbox {
+public:
+    struct Frame {
+        NvimUIState state;
+        // cells changed since the previous frame the consumer took
+        DirtySpans dirty_cells;
+        bool defaults_updated = false;
+    };
+
+    NvimUIFrameMailbox();
+
+    // producer side
+    Frame& back() { return frames_[back_]; }
+    // Publish back() with the changes made since the last publish().
+    // Returns true if the consumer should be notified: there is at most one
+    // pending notification per take().
+    bool publish(DirtySpans const& dirty_cells, bool defaults_updated);
+    // frames published but replaced before the consumer took them
+    uint64_t skipped() const { return skipped_; }
+
+    // consumer side
+    // Makes the newest published frame front(); false if there is none since last time
+    bool take();
+    Frame const& front() const { return frames_[front_]; }
+    bool has_front() const { return has_front_; }
+
+private:
+    static const uint8_t INDEX_MASK = 0x3;
+    static const uint8_t FRESH = 0x4;  // the middle frame is not taken yet
+
+    std::array<Frame, 3> frames_;
+    // index of the middle frame, | FRESH
+    std::atomic<uint8_t> middle_;
+    std::atomic<bool> notify_pending_ = {false};
+
+    // producer only: changes published since the consumer last took a frame
+    uint8_t back_;
+    DirtySpans acc_dirty_cells_;
+    bool acc_defaults_updated_ = false;
+    uint64_t skipped_ = 0;
+
+    // consumer only
+    uint8_t front_;
+    bool has_front_ = false;
+};
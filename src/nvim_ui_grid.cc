@@ -0,0 +1,77 @@
+#include "./nvim_ui_grid.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cstdlib>
+#include <numeric>
+
+void NvimUIGrid::resize(int width, int height) {
+    width_ = width;
+    height_ = height;
+    stride_ = width;
+
+    size_t size = size_t(stride_) * height_;
+    glyphs_.assign(size, GlyphTable::EMPTY);
+    highlights_.assign(size, 0);
+    run_cols_.assign(size, 0);
+    run_texts_.assign(size, QString());
+
+    row_index_.resize(height_);
+    std::iota(row_index_.begin(), row_index_.end(), 0);
+}
+
+void NvimUIGrid::clear_cells(int row, int col_begin, int col_end) {
+    assert(col_begin >= 0 && col_end <= width_);
+    if (col_begin >= col_end)
+        return;
+
+    size_t offset = this->offset(row) + col_begin;
+    size_t count = col_end - col_begin;
+    std::fill_n(glyphs_.begin() + offset, count, GlyphTable::EMPTY);
+    std::fill_n(highlights_.begin() + offset, count, 0);
+    std::fill_n(run_cols_.begin() + offset, count, 0);
+    // run_texts_ are only read where run_cols_ > 0, so they may keep stale text
+}
+
+void NvimUIGrid::clear() {
+    std::fill(glyphs_.begin(), glyphs_.end(), GlyphTable::EMPTY);
+    std::fill(highlights_.begin(), highlights_.end(), 0);
+    std::fill(run_cols_.begin(), run_cols_.end(), 0);
+}
+
+void NvimUIGrid::copy_cells(int dst_row, int src_row, int col_begin, int col_end) {
+    assert(col_begin >= 0 && col_end <= width_);
+    if (col_begin >= col_end)
+        return;
+
+    size_t dst = this->offset(dst_row) + col_begin;
+    size_t src = this->offset(src_row) + col_begin;
+    size_t count = col_end - col_begin;
+    std::copy_n(glyphs_.begin() + src, count, glyphs_.begin() + dst);
+    std::copy_n(highlights_.begin() + src, count, highlights_.begin() + dst);
+    std::copy_n(run_cols_.begin() + src, count, run_cols_.begin() + dst);
+    std::copy_n(run_texts_.begin() + src, count, run_texts_.begin() + dst);
+}
+
+void NvimUIGrid::scroll_rows(int top, int bot, int rows) {
+    assert(top >= 0 && bot <= height_);
+    if (rows == 0 || top >= bot)
+        return;
+    if (std::abs(rows) >= bot - top) {
+        for (int y = top ; y < bot ; y += 1)
+            this->clear_cells(y, 0, width_);
+        return;
+    }
+
+    auto begin = row_index_.begin() + top;
+    auto end = row_index_.begin() + bot;
+    if (rows > 0) {
+        std::rotate(begin, begin + rows, end);
+        for (int y = bot - rows ; y < bot ; y += 1)
+            this->clear_cells(y, 0, width_);
+    } else {
+        std::rotate(begin, end + rows, end);
+        for (int y = top ; y < top - rows ; y += 1)
+            this->clear_cells(y, 0, width_);
+    }
+}
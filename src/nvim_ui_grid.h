@@ -0,0 +1,59 @@
+#pragma once
+
+#include <QString>
+
+#include <cstdint>
+#include <vector>
+
+#include "./glyph_table.h"
+
+// Cell storage of one nvim grid, as a structure of arrays: each attribute
+// lives in its own contiguous row-major array (with a row stride), so the
+// calc handlers stream linearly over just the attributes they touch.
+// Rows are reached through a row index, so full-width scrolls just rotate it.
+class NvimUIGrid {
+public:
+    using highlight_id_t = int;
+    using glyph_id_t = GlyphTable::glyph_id_t;
+
+    void resize(int width, int height);
+
+    int width() const { return width_; }
+    int height() const { return height_; }
+    int stride() const { return stride_; }
+
+    // the text of each cell, see GlyphTable
+    glyph_id_t* glyph_row(int row) { return &glyphs_[this->offset(row)]; }
+    glyph_id_t const* glyph_row(int row) const { return &glyphs_[this->offset(row)]; }
+    highlight_id_t* highlight_row(int row) { return &highlights_[this->offset(row)]; }
+    highlight_id_t const* highlight_row(int row) const { return &highlights_[this->offset(row)]; }
+    // Text runs drawn as one piece. At the first cell of a run, run_cols is
+    // its length and run_text its text; at the following cells, run_cols is
+    // the (negative) offset back to the first one; 0 for whitespace / empty.
+    int* run_cols_row(int row) { return &run_cols_[this->offset(row)]; }
+    int const* run_cols_row(int row) const { return &run_cols_[this->offset(row)]; }
+    QString* run_text_row(int row) { return &run_texts_[this->offset(row)]; }
+    QString const* run_text_row(int row) const { return &run_texts_[this->offset(row)]; }
+
+    // reset cells [col_begin, col_end) of a row
+    void clear_cells(int row, int col_begin, int col_end);
+    void clear();
+    // copy cells [col_begin, col_end) from one row to another
+    void copy_cells(int dst_row, int src_row, int col_begin, int col_end);
+    // Move full rows [top, bot) up by `rows` (down if negative), clearing the
+    // rows left behind. Only the row index moves, no cell is copied.
+    void scroll_rows(int top, int bot, int rows);
+
+private:
+    int width_ = 0, height_ = 0;
+    int stride_ = 0;
+
+    // row -> physical row in the arrays
+    std::vector<int> row_index_;
+    size_t offset(int row) const { return size_t(row_index_[row]) * stride_; }
+
+    std::vector<glyph_id_t> glyphs_;
+    std::vector<highlight_id_t> highlights_;
+    std::vector<int> run_cols_;
+    std::vector<QString> run_texts_;
+};
@@ -1,22 +1,16 @@
 #pragma once
 
 
+#include <array>
+#include <cstdint>
 #include <memory>
+#include <string>
+#include <vector>
 
 #include <QColor>
 #include <QPoint>
 #include <QSize>
-
-#include <msgpack.hpp>
-
-namespace msgpack::adaptor {
-
-template<>
-struct convert<QColor> {
-    msgpack::object const& operator()(msgpack::object const& obj, QColor& optional_color) const;
-};
-
-}
+#include <QString>
 
 struct NvimUIState {
 
@@ -29,38 +23,123 @@ struct NvimUIState {
              underline = false,
              undercurl = false;
         int blend = 0;
-
-        MSGPACK_DEFINE_MAP(foreground, background, special,
-                           reverse, italic, bold, strikethrough, underline, undercurl,
-                           blend);
     };
 
     struct Modeinfo {
-        std::string cursor_shape = "block"; // block, horizontal, vertical
+        enum CursorShape {
+            BLOCK,
+            HORIZONTAL,
+            VERTICAL,
+        };
+
+        CursorShape cursor_shape = BLOCK;
         int cell_percentage = 100;
         // TODO: blink* not implemented
         // TODO: attr_id not implemented
         std::string short_name;
         std::string name;
+    };
 
-        MSGPACK_DEFINE_MAP(cursor_shape, cell_percentage,
-                           short_name, name);
+    // All highlights, dense by id. Colors are resolved against the defaults,
+    // and swapped already for reverse ones. Ids never defined (as 0) map to
+    // the defaults.
+    struct HighlightTable {
+        // changes whenever the table does
+        uint64_t version = 0;
+        std::vector<Highlight> highlights;
+
+        Highlight const& operator[](int id) const {
+            return (id > 0 && id < int(highlights.size())) ? highlights[id] : highlights[0];
+        }
     };
 
     struct Cell {
-        std::shared_ptr<Highlight> highlight;
+        int highlight_id = 0;
         QString contiguous_text;
-        int contiguous_cols;
+        int contiguous_cols = 0;
     };
 
+    // Rows are immutable once published: a snapshot shares every row that
+    // did not change since the previous one.
+    using Row = std::vector<Cell>;
+
     QColor default_foreground;
     QColor default_background;
     QColor default_special;
 
-    QPoint cursor;
+    // ext_popupmenu: drawn by the widget over the grids
+    struct Popupmenu {
+        struct Items {
+            // word, kind and menu of each item
+            std::vector<std::array<QString, 3>> lines;
+            // in cells, of the longest text of each column (0: the column is empty)
+            std::array<int, 3> column_widths = {};
+            // in cells, of the columns and one cell between non-empty ones
+            int width = 0;
+        };
+        // nullptr if hidden; replaced (not changed) by each popupmenu_show
+        std::shared_ptr<Items const> items;
+        int selected = -1;
+        // in global grid cells, the menu goes below (or above) it
+        QPoint anchor;
+        // of the Pmenu and PmenuSel highlight groups
+        int highlight_id = 0;
+        int selected_highlight_id = 0;
+    };
+
+    // ext_cmdline: drawn by the widget over the last rows, wrapped to the grid width
+    struct Cmdline {
+        bool visible = false;
+        // (highlight id, text), with firstc / prompt / indent first
+        std::vector<std::pair<int, QString>> chunks;
+        // in cells from the start of the line
+        int cursor = 0;
+
+        bool operator==(Cmdline const& other) const {
+            return visible == other.visible && chunks == other.chunks && cursor == other.cursor;
+        }
+        bool operator!=(Cmdline const& other) const { return !(*this == other); }
+    };
+
+    // nvim's grids (ext_multigrid): the global grid (1), windows, floats and
+    // the message area
+    struct Grid {
+        int id = 0;
+        // top left, in cells of the global grid
+        QPoint pos;
+        QSize size = QSize(0, 0);
+        std::vector<std::shared_ptr<Row const>> cells;
+    };
+
+    // numbered by flush, from 1; also tags the trace events of its work
+    uint64_t frame_id = 0;
+
+    // size of the global grid
     QSize size = QSize(0, 0);
+    // the visible grids, bottom first
+    std::vector<Grid> grids;
+
+    // the grid holding the cursor (0 if hidden), and the cursor in it
+    int cursor_grid = 0;
+    QPoint cursor;
     Modeinfo modeinfo;
 
-    std::vector<std::vector<Cell>> cells;
+    std::shared_ptr<HighlightTable const> highlights;
+
+    Popupmenu popupmenu;
+    Cmdline cmdline;
+
+    Grid const* find_grid(int id) const {
+        for (auto const& grid: grids)
+            if (grid.id == id)
+                return &grid;
+        return nullptr;
+    }
+
+    // the cursor in global grid cells, (-1, -1) if hidden
+    QPoint cursor_position() const {
+        Grid const* grid = this->find_grid(cursor_grid);
+        return grid ? grid->pos + cursor : QPoint(-1, -1);
+    }
 
 };
@@ -8,10 +8,14 @@
 #include <QWheelEvent>
 #include <QCursor>
 
+#include <algorithm>
+#include <climits>
 #include <cmath>
 
 #include "./nvim_ui_widget.h"
 #include "./keycodes.h"
+#include "./glyph_table.h"
+#include "./tracer.h"
 
 unsigned int qHash(QColor color) {
     int r, g, b;
@@ -23,6 +27,10 @@ unsigned int qHash(QColor color) {
 #define ASCII_STRING " !\"#$%&'()*+,-./0123456789:;<=>?@ABCDEFGHIJKLMNOPQRSTUVWXYZ[\\]^_`abcdefghijklmnopqrstuvwxyz{|}~"
 #define STATIC_TEXTS_CACHE_SIZE 4096
 #define QPEN_CACHE_SIZE 4096
+#define POPUPMENU_MAX_ROWS 15
+#define HUD_REFRESH_MS 500
+#define HUD_MARGIN 8
+#define HUD_PADDING 4
 
 
 NvimUIWidget::NvimUIWidget(QWidget* parent):
@@ -40,6 +48,9 @@ cache_pens_(QPEN_CACHE_SIZE) {
     this->setUpdateBehavior(PartialUpdate);
 #endif
     this->setFont(QFontDatabase::systemFont(QFontDatabase::FixedFont));
+
+    hud_timer_.setInterval(HUD_REFRESH_MS);
+    connect(&hud_timer_, &QTimer::timeout, this, &NvimUIWidget::refreshHud);
 }
 
 void NvimUIWidget::calculateGrid() {
@@ -72,25 +83,361 @@ void NvimUIWidget::setFont(QFont const& font) {
     this->update();
 }
 
-void NvimUIWidget::updateState(std::shared_ptr<NvimUIState> state,
-                               QRegion dirty_cells, bool defaults_updated) {
-    state_ = state;
+void NvimUIWidget::updateState() {
+    QRegion damage = this->takeFrame();
+    if (!damage.isEmpty())
+        this->update(damage);
+}
+
+QRegion NvimUIWidget::takeFrame() {
+    tracer::Scope trace_scope("updateState");
+    if (!frames_ || !frames_->take())
+        return QRegion();
+    trace_scope.set_frame_id(frames_->front().state.frame_id);
+    // the queued delivery of `updated`
+    tracer::flow(tracer::FLOW_STEP, frames_->front().state.frame_id);
+    if (perf_stats_)
+        PerfStats::add(perf_stats_->frames_taken, 1);
+
+    auto const& frame = frames_->front();
+    state_ = &frame.state;
+
+    if (frame.defaults_updated) {
+        if (state_->popupmenu.items != shown_popupmenu_.items)
+            popupmenu_first_ = 0;
+        shown_popupmenu_ = state_->popupmenu;
+        int rows = this->popupmenuCells(shown_popupmenu_).height();
+        popupmenu_first_ = this->popupmenuFirstItem(shown_popupmenu_, rows, popupmenu_first_);
+        shown_cmdline_ = state_->cmdline;
+        this->layoutCmdline();
+        popupmenu_pixmap_ = QPixmap();
+        cmdline_pixmap_ = QPixmap();
+        return this->rect();
+    }
+
+    QRegion damage;
+    if (!frame.dirty_cells.empty())
+        damage = this->spansToPixels(frame.dirty_cells);
+    this->updateOverlays(&damage);
+    return damage;
+}
+
+QRegion NvimUIWidget::spansToPixels(DirtySpans const& cells) const {
+    // One rect per run of rows with the same span, built directly in
+    // QRegion's banded form (y-x sorted, not overlapping) so no union is needed.
+    damage_rects_.clear();
+    int bottom = INT_MIN;  // of the last band
+    for (int y = cells.first_row() ; y < cells.last_row() ; ) {
+        auto span = cells.row(y);
+        int end_y = y + 1;
+        while (end_y < cells.last_row() && cells.row(end_y) == span)
+            end_y += 1;
+        if (span.first < span.second) {
+            QRect rect = this->cellsToPixels(QRect(span.first, y, span.second - span.first, end_y - y));
+            if (!damage_rects_.empty() && rect.top() < bottom) {
+                // rows share a pixel line when the cell height is fractional
+                QRect& last = damage_rects_.back();
+                QRect shared(QPoint(std::min(last.left(), rect.left()), rect.top()),
+                             QPoint(std::max(last.right(), rect.right()), bottom - 1));
+                last.setBottom(rect.top() - 1);
+                if (last.isEmpty())
+                    damage_rects_.pop_back();
+                damage_rects_.push_back(shared);
+                rect.setTop(bottom);
+            }
+            if (!rect.isEmpty()) {
+                damage_rects_.push_back(rect);
+                bottom = rect.bottom() + 1;
+            }
+        }
+        y = end_y;
+    }
+
+    QRegion region;
+    region.setRects(damage_rects_.data(), damage_rects_.size());
+    return region;
+}
+
+void NvimUIWidget::pixelsToSpans(QRegion const& pixels, DirtySpans* cells) const {
+    cells->clear();
+    for (auto const& rect: pixels) {
+        // every cell touching a pixel of the rect
+        int left = std::floor((rect.left() - grid_offset_.x()) / cell_size_.width());
+        int right = std::ceil((rect.right() + 1 - grid_offset_.x()) / cell_size_.width());
+        int top = std::floor((rect.top() - grid_offset_.y()) / cell_size_.height());
+        int bottom = std::ceil((rect.bottom() + 1 - grid_offset_.y()) / cell_size_.height());
+        cells->mark(QRect(QPoint(left, top), QPoint(right - 1, bottom - 1)));
+    }
+}
+
+QRect NvimUIWidget::cellsToPixels(QRect const& cells) const {
+    if (cells.isEmpty())
+        return QRect();
+    double left = grid_offset_.x() + cells.left() * cell_size_.width();
+    double top = grid_offset_.y() + cells.top() * cell_size_.height();
+    double right = left + cells.width() * cell_size_.width();
+    double bottom = top + cells.height() * cell_size_.height();
+    return QRect(QPoint(std::floor(left), std::floor(top)),
+                 QPoint(std::ceil(right), std::ceil(bottom)));
+}
+
+QRect NvimUIWidget::popupmenuCells(NvimUIState::Popupmenu const& popupmenu) const {
+    if (!state_ || !popupmenu.items || popupmenu.items->lines.empty())
+        return QRect();
+
+    QSize screen = state_->size;
+    int width = std::min(popupmenu.items->width + 2, screen.width());  // one cell of padding each side
+    int height = std::min<int>(popupmenu.items->lines.size(), POPUPMENU_MAX_ROWS);
+
+    int x = std::max(0, std::min(popupmenu.anchor.x(), screen.width() - width));
+    // below the anchor if it fits, else above
+    int space_below = screen.height() - (popupmenu.anchor.y() + 1);
+    int space_above = popupmenu.anchor.y();
+    int y = 0;
+    if (height <= space_below || space_below >= space_above) {
+        height = std::min(height, std::max(1, space_below));
+        y = popupmenu.anchor.y() + 1;
+    } else {
+        height = std::min(height, space_above);
+        y = popupmenu.anchor.y() - height;
+    }
+    return QRect(x, y, width, height);
+}
+
+int NvimUIWidget::popupmenuFirstItem(NvimUIState::Popupmenu const& popupmenu, int rows, int first) const {
+    if (!popupmenu.items || rows <= 0)
+        return 0;
+    // a selection moving within the rows shown does not scroll
+    if (popupmenu.selected >= 0) {
+        if (popupmenu.selected < first)
+            first = popupmenu.selected;
+        else if (popupmenu.selected >= first + rows)
+            first = popupmenu.selected - rows + 1;
+    }
+    return std::max(0, std::min<int>(first, popupmenu.items->lines.size() - rows));
+}
+
+void NvimUIWidget::layoutCmdline() {
+    cmdline_runs_.clear();
+    cmdline_rows_ = 0;
+    cmdline_cursor_ = QPoint(0, 0);
+    cmdline_layout_width_ = state_ ? state_->size.width() : 0;
+    if (!shown_cmdline_.visible || cmdline_layout_width_ <= 0)
+        return;
+
+    // A char that does not fit goes to the next row, like in nvim's own
+    // cmdline (a wide char leaves the last cell empty). The cursor counts the
+    // cells of the text, without that padding.
+    int width = cmdline_layout_width_;
+    QPoint cell(0, 0);
+    int text_cells = 0;
+    bool cursor_found = false;
+    for (auto const& chunk: shown_cmdline_.chunks) {
+        QString const& text = chunk.second;
+        bool new_run = true;
+        for (int i = 0 ; i < text.size() ; ) {
+            int len = (text.at(i).isHighSurrogate() && i + 1 < text.size()) ? 2 : 1;
+            QString c = text.mid(i, len);
+            i += len;
+            // combining marks (0 cells) stay with the previous char
+            int cells = GlyphTable::cell_width(c);
+            if (cells > 0) {
+                if (cell.x() + cells > width) {
+                    cell = QPoint(0, cell.y() + 1);
+                    new_run = true;
+                }
+                if (!cursor_found && text_cells >= shown_cmdline_.cursor) {
+                    cmdline_cursor_ = cell;
+                    cursor_found = true;
+                }
+            }
+            if (new_run) {
+                cmdline_runs_.push_back({chunk.first, cell, 0, QString()});
+                new_run = false;
+            }
+            cmdline_runs_.back().text += c;
+            cmdline_runs_.back().cells += cells;
+            cell.rx() += cells;
+            text_cells += cells;
+        }
+    }
+    // after the text: on a new row if the last one is full
+    if (!cursor_found) {
+        if (cell.x() >= width)
+            cell = QPoint(0, cell.y() + 1);
+        cmdline_cursor_ = cell;
+    }
+    cmdline_rows_ = std::max(cell.y(), cmdline_cursor_.y()) + 1;
+}
+
+QRect NvimUIWidget::cmdlineCells() const {
+    if (!state_ || cmdline_rows_ == 0 || state_->size.isEmpty())
+        return QRect();
+    // taller than the grid: the last rows are shown
+    int rows = std::min(cmdline_rows_, state_->size.height());
+    return QRect(0, state_->size.height() - rows, cmdline_layout_width_, rows);
+}
+
+QPoint NvimUIWidget::inputCursorCell() const {
+    if (!state_)
+        return QPoint(0, 0);
+    QRect cells = this->cmdlineCells();
+    if (cells.isEmpty())
+        return state_->cursor_position();
+    return QPoint(cmdline_cursor_.x(), cells.bottom() - (cmdline_rows_ - 1 - cmdline_cursor_.y()));
+}
 
-    if (defaults_updated) {
-        this->update();
+void NvimUIWidget::updateOverlays(QRegion* damage) {
+    uint64_t highlights_version = state_->highlights ? state_->highlights->version : 0;
+    bool highlights_changed = highlights_version != overlay_highlights_version_;
+    overlay_highlights_version_ = highlights_version;
+
+    auto const& popupmenu = state_->popupmenu;
+    QRect old_cells = this->popupmenuCells(shown_popupmenu_);
+    QRect new_cells = this->popupmenuCells(popupmenu);
+    int old_first = popupmenu_first_;
+    int new_first = this->popupmenuFirstItem(popupmenu, new_cells.height(),
+                                             popupmenu.items != shown_popupmenu_.items ? 0 : popupmenu_first_);
+
+    if (highlights_changed || popupmenu.items != shown_popupmenu_.items
+        || old_cells != new_cells || old_first != new_first) {
+        *damage |= this->cellsToPixels(old_cells);
+        *damage |= this->cellsToPixels(new_cells);
+        popupmenu_pixmap_ = QPixmap();
+    } else if (popupmenu.selected != shown_popupmenu_.selected) {
+        for (int item: {shown_popupmenu_.selected, popupmenu.selected}) {
+            int row = item - new_first;
+            if (row < 0 || row >= new_cells.height())
+                continue;
+            popupmenu_stale_rows_.push_back(row);
+            *damage |= this->cellsToPixels(QRect(new_cells.x(), new_cells.y() + row, new_cells.width(), 1));
+        }
+    }
+    shown_popupmenu_ = popupmenu;
+    popupmenu_first_ = new_first;
+
+    if (highlights_changed || state_->cmdline != shown_cmdline_
+        || state_->size.width() != cmdline_layout_width_) {
+        // all the rows covered, before and after
+        *damage |= this->cellsToPixels(this->cmdlineCells());
+        // the grid cursor is hidden while the cmdline is shown (2 cells: double width)
+        if (state_->cmdline.visible != shown_cmdline_.visible)
+            *damage |= this->cellsToPixels(QRect(state_->cursor_position(), QSize(2, 1)));
+        shown_cmdline_ = state_->cmdline;
+        this->layoutCmdline();
+        *damage |= this->cellsToPixels(this->cmdlineCells());
+        cmdline_pixmap_ = QPixmap();
+    }
+}
+
+void NvimUIWidget::paintPopupmenu(QPainter* painter, QRegion const& redraw_region) {
+    if (!state_->highlights)
         return;
+
+    QRect cells = this->popupmenuCells(shown_popupmenu_);
+    QRect pixels = this->cellsToPixels(cells);
+    if (cells.isEmpty() || !redraw_region.intersects(pixels))
+        return;
+
+    double dpr = this->devicePixelRatioF();
+    if (popupmenu_pixmap_.isNull() || popupmenu_pixmap_.size() != pixels.size() * dpr) {
+        popupmenu_pixmap_ = QPixmap(pixels.size() * dpr);
+        popupmenu_pixmap_.setDevicePixelRatio(dpr);
+        popupmenu_stale_rows_.clear();
+        for (int row = 0 ; row < cells.height() ; row += 1)
+            popupmenu_stale_rows_.push_back(row);
     }
 
-    QRegion dirty_pixels;
-    for (auto const& rect: dirty_cells) {
-        double left = grid_offset_.x() + rect.left() * cell_size_.width();
-        double top = grid_offset_.y() + rect.top() * cell_size_.height();
-        double right = left + rect.width() * cell_size_.width();
-        double bottom = top + rect.height() * cell_size_.height();
-        dirty_pixels |= QRect(QPoint(std::floor(left), std::floor(top)),
-                              QPoint(std::ceil(right), std::ceil(bottom)));
+    if (!popupmenu_stale_rows_.empty()) {
+        QPainter pixmap_painter(&popupmenu_pixmap_);
+        pixmap_painter.setFont(font_);
+        for (int row: popupmenu_stale_rows_)
+            this->renderPopupmenuRow(&pixmap_painter, cells, row);
+        popupmenu_stale_rows_.clear();
     }
-    this->update(dirty_pixels);
+
+    painter->drawPixmap(pixels.topLeft(), popupmenu_pixmap_);
+}
+
+void NvimUIWidget::renderPopupmenuRow(QPainter* painter, QRect const& cells, int row) {
+    auto const& popupmenu = shown_popupmenu_;
+    int item = popupmenu_first_ + row;
+    if (item >= int(popupmenu.items->lines.size()))
+        return;
+
+    bool selected = item == popupmenu.selected;
+    auto const& highlight = (*state_->highlights)[selected ? popupmenu.selected_highlight_id : popupmenu.highlight_id];
+    QColor background = highlight.background, foreground = highlight.foreground;
+    // Pmenu / PmenuSel not known (nvim < 0.5): still tell the selection apart
+    if (selected && popupmenu.selected_highlight_id == 0)
+        std::swap(background, foreground);
+
+    // the pixmap starts at the pixel bound of the cells
+    QPointF origin = QPointF(grid_offset_.x() + cells.x() * cell_size_.width(),
+                             grid_offset_.y() + cells.y() * cell_size_.height())
+        - QPointF(this->cellsToPixels(cells).topLeft());
+    QRectF row_rect(0, origin.y() + row * cell_size_.height(),
+                    popupmenu_pixmap_.width() / popupmenu_pixmap_.devicePixelRatioF(), cell_size_.height());
+    if (row == 0)
+        row_rect.setTop(0);
+    if (row == cells.height() - 1)
+        row_rect.setBottom(popupmenu_pixmap_.height() / popupmenu_pixmap_.devicePixelRatioF());
+
+    painter->fillRect(row_rect, background);
+    painter->setPen(foreground);
+    // each column at its own offset, after one cell of padding
+    int col = 1;
+    for (int j = 0 ; j < 3 ; j += 1) {
+        int column_width = popupmenu.items->column_widths[j];
+        if (column_width == 0)
+            continue;
+        painter->drawText(QPointF(origin.x() + col * cell_size_.width(),
+                                  origin.y() + row * cell_size_.height() + font_metrics_.ascent()),
+                          popupmenu.items->lines[item][j]);
+        col += column_width + 1;
+    }
+}
+
+void NvimUIWidget::paintCmdline(QPainter* painter, QRegion const& redraw_region) {
+    if (!state_->highlights)
+        return;
+
+    QRect cells = this->cmdlineCells();
+    QRect pixels = this->cellsToPixels(cells);
+    if (cells.isEmpty() || !redraw_region.intersects(pixels))
+        return;
+
+    double dpr = this->devicePixelRatioF();
+    if (cmdline_pixmap_.isNull() || cmdline_pixmap_.size() != pixels.size() * dpr) {
+        cmdline_pixmap_ = QPixmap(pixels.size() * dpr);
+        cmdline_pixmap_.setDevicePixelRatio(dpr);
+
+        QPainter pixmap_painter(&cmdline_pixmap_);
+        pixmap_painter.setFont(font_);
+        pixmap_painter.fillRect(QRectF(0, 0, pixels.width(), pixels.height()), state_->default_background);
+
+        QPointF origin = QPointF(grid_offset_.x(), grid_offset_.y() + cells.y() * cell_size_.height())
+            - QPointF(pixels.topLeft());
+        int first_row = cmdline_rows_ - cells.height();
+        for (auto const& run: cmdline_runs_) {
+            if (run.cell.y() < first_row)
+                continue;
+            auto const& highlight = (*state_->highlights)[run.highlight_id];
+            QRectF run_rect(origin.x() + run.cell.x() * cell_size_.width(),
+                            origin.y() + (run.cell.y() - first_row) * cell_size_.height(),
+                            run.cells * cell_size_.width(), cell_size_.height());
+            pixmap_painter.fillRect(run_rect, highlight.background);
+            pixmap_painter.setPen(highlight.foreground);
+            pixmap_painter.drawText(QPointF(run_rect.left(), run_rect.top() + font_metrics_.ascent()), run.text);
+        }
+
+        pixmap_painter.setPen(state_->default_foreground);
+        double cursor_x = origin.x() + cmdline_cursor_.x() * cell_size_.width() + 1;
+        double cursor_y = origin.y() + (cmdline_cursor_.y() - first_row) * cell_size_.height();
+        pixmap_painter.drawLine(QLineF(cursor_x, cursor_y, cursor_x, cursor_y + cell_size_.height()));
+    }
+
+    painter->drawPixmap(pixels.topLeft(), cmdline_pixmap_);
 }
 
 void NvimUIWidget::paintDebugGrid(QPaintEvent* event, QPainter* painter) {
@@ -117,9 +464,14 @@ void NvimUIWidget::paintEvent(QPaintEvent* event) {
 
     auto redraw_region = event->region();
     auto t0 = std::chrono::steady_clock::now();
+    TRACE_SCOPE_FRAME("paintEvent", state_->frame_id);
 
     QPainter painter(this);
     painter.setFont(font_);
+    // runs of lower grids may reach under floats outside the region
+    painter.setClipRegion(redraw_region);
+    // the region in cells, tested per run instead of QRegion::intersects
+    this->pixelsToSpans(redraw_region, &redraw_cells_);
 
     // always draw areas outside grid
     {
@@ -135,111 +487,124 @@ void NvimUIWidget::paintEvent(QPaintEvent* event) {
 
     int text_draw_cnt = 0, text_draw_noncached_cnt = 0;
 
-    QSize nvim_size = state_->size;
-    for (int y = 0 ; y < nvim_size.height() ; y += 1) {
-        for (int x = 0 ; x < nvim_size.width() ;) {
-            auto const& cell = state_->cells[y][x];
-            QPointF pt_lefttop(grid_offset_.x() + x * cell_size_.width(),
-                               grid_offset_.y() + y * cell_size_.height());
-            int affected_cols = std::max(1, cell.contiguous_cols);
-
-            QRectF affected_rect(pt_lefttop, QSizeF(affected_cols * cell_size_.width(), cell_size_.height()));
-            QRect affected_rect_bound(
-                    QPoint(std::floor(affected_rect.left()), std::floor(affected_rect.top())),
-                    QPoint(std::ceil(affected_rect.right()), std::ceil(affected_rect.bottom())));
-            if (!redraw_region.intersects(affected_rect_bound)) {
-                x += affected_cols;
+    auto const& highlights = *state_->highlights;
+    // grids bottom first: floats and the message area paint over the windows
+    for (auto const& grid: state_->grids) {
+        int top = std::max(grid.pos.y(), redraw_cells_.first_row());
+        int bottom = std::min(grid.pos.y() + grid.size.height(), redraw_cells_.last_row());
+        for (int global_y = top ; global_y < bottom ; global_y += 1) {
+            if (!redraw_cells_.intersects(global_y, grid.pos.x(), grid.pos.x() + grid.size.width()))
                 continue;
-            }
+            int y = global_y - grid.pos.y();
+            auto const& row = *grid.cells[y];
+            for (int x = 0 ; x < grid.size.width() ;) {
+                auto const& cell = row[x];
+                QPointF pt_lefttop(grid_offset_.x() + (grid.pos.x() + x) * cell_size_.width(),
+                                   grid_offset_.y() + (grid.pos.y() + y) * cell_size_.height());
+                int affected_cols = std::max(1, cell.contiguous_cols);
+
+                QRectF affected_rect(pt_lefttop, QSizeF(affected_cols * cell_size_.width(), cell_size_.height()));
+                if (!redraw_cells_.intersects(global_y, grid.pos.x() + x, grid.pos.x() + x + affected_cols)) {
+                    x += affected_cols;
+                    continue;
+                }
 
-            auto const& highlight = *cell.highlight;
-            bool reverse_color = highlight.reverse;
-            bool draw_horizontal_cursor = false;
-            bool draw_vertical_cursor = false;
-
-            // draw cursor?
-            // The cursor (if valid) must be at the begin of contiguous cols
-            if (QPoint(x, y) == state_->cursor) {
-                auto const& modeinfo = state_->modeinfo;
-                // TODO: modeinfo.attr_id seems useless now, we just use reversed color for now
-                if (modeinfo.cursor_shape == "block")
-                    reverse_color = !reverse_color;
-                if (modeinfo.cursor_shape == "horizontal")
-                    draw_horizontal_cursor = true;
-                if (modeinfo.cursor_shape == "vertical")
-                    draw_vertical_cursor = true;
-            }
+                // colors are final, reverse already applied
+                auto const& highlight = highlights[cell.highlight_id];
+                bool reverse_color = false;
+                bool draw_horizontal_cursor = false;
+                bool draw_vertical_cursor = false;
+
+                // draw cursor?
+                // The cursor (if valid) must be at the begin of contiguous cols
+                // The cmdline shows its own cursor instead
+                if (grid.id == state_->cursor_grid && QPoint(x, y) == state_->cursor
+                    && !state_->cmdline.visible) {
+                    auto const& modeinfo = state_->modeinfo;
+                    // TODO: modeinfo.attr_id seems useless now, we just use reversed color for now
+                    if (modeinfo.cursor_shape == NvimUIState::Modeinfo::BLOCK)
+                        reverse_color = !reverse_color;
+                    if (modeinfo.cursor_shape == NvimUIState::Modeinfo::HORIZONTAL)
+                        draw_horizontal_cursor = true;
+                    if (modeinfo.cursor_shape == NvimUIState::Modeinfo::VERTICAL)
+                        draw_vertical_cursor = true;
+                }
 
-            auto highlight_fg = highlight.foreground.isValid() ? highlight.foreground : state_->default_foreground;
-            auto highlight_bg = highlight.background.isValid() ? highlight.background : state_->default_background;
+                QColor const& highlight_fg = highlight.foreground;
+                QColor const& highlight_bg = highlight.background;
 
-            painter.fillRect(affected_rect,
-                             reverse_color ?  highlight_fg : highlight_bg);
+                painter.fillRect(affected_rect,
+                                 reverse_color ?  highlight_fg : highlight_bg);
 
-            QColor const& pen_color = reverse_color ?  highlight_bg : highlight_fg;
-            QPen* pen = cache_pens_.object(pen_color);
-            if (!pen) {
-                pen = new QPen(pen_color);
-                cache_pens_.insert(pen_color, pen);
-            }
-            painter.setPen(*pen);
-
-            if (draw_horizontal_cursor)
-                painter.drawLine(QLineF(affected_rect.bottomLeft() - QPointF(0, 1),
-                                        affected_rect.bottomRight() - QPointF(0, 1)));
-            if (draw_vertical_cursor)
-                painter.drawLine(QLineF(affected_rect.topLeft() + QPointF(1, 0),
-                                        affected_rect.bottomLeft() + QPointF(1, 0)));
-
-            if (cell.contiguous_cols > 0) {
-                QFont font = font_;
-
-                uint32_t text_flags = 0;
-                if (highlight.italic) {
-                    text_flags |= (1 << 1);
-                    font.setItalic(true);
-                }
-                if (highlight.bold) {
-                    text_flags |= (1 << 2);
-                    font.setBold(true);
+                QColor const& pen_color = reverse_color ?  highlight_bg : highlight_fg;
+                QPen* pen = cache_pens_.object(pen_color);
+                if (!pen) {
+                    pen = new QPen(pen_color);
+                    cache_pens_.insert(pen_color, pen);
                 }
+                painter.setPen(*pen);
 
-                QPair<uint32_t, QString> static_text_key(text_flags, cell.contiguous_text);
-                QStaticText *static_text = static_texts_.object(static_text_key);
-                if (!static_text) {
-                    static_text = new QStaticText(cell.contiguous_text);
-                    static_text->setPerformanceHint(QStaticText::AggressiveCaching);
-                    static_text->setTextFormat(Qt::PlainText);
-                    static_text->prepare(QTransform(), font);
-                    static_texts_.insert(static_text_key, static_text);
-                    text_draw_noncached_cnt += 1;
-                }
-                text_draw_cnt += 1;
-
-                painter.setFont(font);
-                // painter.drawText(pt_lefttop + QPointF(0, font_metrics_.ascent()),
-                //                  cell.contiguous_text);
-                painter.drawStaticText(
-                        QPointF(pt_lefttop.x(),
-                                pt_lefttop.y() + font_metrics_.lineSpacing() - font_metrics_.height()
-                                    - (static_text->size().height() - cell_size_.height()) * font_metrics_.ascent() / font_metrics_.height()),  // align baseline for fallback font
-                        *static_text);
-
-                if (highlight.underline || highlight.undercurl) // TODO: curl?
+                if (draw_horizontal_cursor)
                     painter.drawLine(QLineF(affected_rect.bottomLeft() - QPointF(0, 1),
                                             affected_rect.bottomRight() - QPointF(0, 1)));
-                if (highlight.strikethrough)
-                    painter.drawLine(QLineF(affected_rect.topLeft() + QPointF(0, affected_rect.height() / 2),
-                                            affected_rect.topRight() + QPointF(0, affected_rect.height() / 2)));
-            }
+                if (draw_vertical_cursor)
+                    painter.drawLine(QLineF(affected_rect.topLeft() + QPointF(1, 0),
+                                            affected_rect.bottomLeft() + QPointF(1, 0)));
+
+                if (cell.contiguous_cols > 0) {
+                    QFont font = font_;
+
+                    uint32_t text_flags = 0;
+                    if (highlight.italic) {
+                        text_flags |= (1 << 1);
+                        font.setItalic(true);
+                    }
+                    if (highlight.bold) {
+                        text_flags |= (1 << 2);
+                        font.setBold(true);
+                    }
+
+                    QPair<uint32_t, QString> static_text_key(text_flags, cell.contiguous_text);
+                    QStaticText *static_text = static_texts_.object(static_text_key);
+                    if (!static_text) {
+                        static_text = new QStaticText(cell.contiguous_text);
+                        static_text->setPerformanceHint(QStaticText::AggressiveCaching);
+                        static_text->setTextFormat(Qt::PlainText);
+                        static_text->prepare(QTransform(), font);
+                        static_texts_.insert(static_text_key, static_text);
+                        text_draw_noncached_cnt += 1;
+                    }
+                    text_draw_cnt += 1;
+
+                    painter.setFont(font);
+                    // painter.drawText(pt_lefttop + QPointF(0, font_metrics_.ascent()),
+                    //                  cell.contiguous_text);
+                    painter.drawStaticText(
+                            QPointF(pt_lefttop.x(),
+                                    pt_lefttop.y() + font_metrics_.lineSpacing() - font_metrics_.height()
+                                        - (static_text->size().height() - cell_size_.height()) * font_metrics_.ascent() / font_metrics_.height()),  // align baseline for fallback font
+                            *static_text);
+
+                    if (highlight.underline || highlight.undercurl) // TODO: curl?
+                        painter.drawLine(QLineF(affected_rect.bottomLeft() - QPointF(0, 1),
+                                                affected_rect.bottomRight() - QPointF(0, 1)));
+                    if (highlight.strikethrough)
+                        painter.drawLine(QLineF(affected_rect.topLeft() + QPointF(0, affected_rect.height() / 2),
+                                                affected_rect.topRight() + QPointF(0, affected_rect.height() / 2)));
+                }
 
-            x += affected_cols;
+                x += affected_cols;
+            }
         }
     }
 
+    this->paintPopupmenu(&painter, redraw_region);
+    this->paintCmdline(&painter, redraw_region);
+    this->paintHud(&painter, redraw_region);
+
     if (!im_preedit_text_.isEmpty()) {
         QPen pen(state_->default_foreground);
-        auto cursor = state_->cursor;
+        auto cursor = this->inputCursorCell();
         QPointF pt_lefttop(grid_offset_.x() + cursor.x() * cell_size_.width(),
                            grid_offset_.y() + cursor.y() * cell_size_.height());
         QFont font = font_;
@@ -253,12 +618,65 @@ void NvimUIWidget::paintEvent(QPaintEvent* event) {
 
     // this->paintDebugGrid(event, &painter);
 
-    auto t1 = std::chrono::steady_clock::now();
-    qDebug() << "paintEvent costs" << std::chrono::duration_cast<std::chrono::microseconds>(t1-t0).count() << "us"
-        << redraw_region.boundingRect() << text_draw_noncached_cnt << text_draw_cnt;
+    // the first paint showing the frame ends its flow
+    if (state_->frame_id != painted_frame_id_) {
+        tracer::flow(tracer::FLOW_END, state_->frame_id);
+        painted_frame_id_ = state_->frame_id;
+    }
+
+    if (perf_stats_) {
+        PerfStats::add(perf_stats_->static_text_hits, text_draw_cnt - text_draw_noncached_cnt);
+        PerfStats::add(perf_stats_->static_text_misses, text_draw_noncached_cnt);
+        perf_stats_->paint_time.record(std::chrono::steady_clock::now() - t0);
+    }
+}
+
+void NvimUIWidget::toggleHud() {
+    hud_visible_ = !hud_visible_;
+    if (hud_visible_) {
+        this->refreshHud();
+        hud_timer_.start();
+    } else {
+        hud_timer_.stop();
+        this->update(hud_rect_);
+        hud_rect_ = QRect();
+    }
+}
+
+void NvimUIWidget::refreshHud() {
+    hud_lines_ = perf_stats_ ? perf_stats_->describe() : QStringList("no stats");
+
+    double width = 0;
+    for (auto const& line: hud_lines_)
+        width = std::max(width, font_metrics_.width(line));
+    QSize size(std::ceil(width) + HUD_PADDING * 2,
+               std::ceil(hud_lines_.size() * font_metrics_.lineSpacing()) + HUD_PADDING * 2);
+
+    this->update(hud_rect_);
+    hud_rect_ = QRect(QPoint(this->width() - size.width() - HUD_MARGIN, HUD_MARGIN), size);
+    this->update(hud_rect_);
+}
+
+void NvimUIWidget::paintHud(QPainter* painter, QRegion const& redraw_region) {
+    if (!hud_visible_ || !redraw_region.intersects(hud_rect_))
+        return;
+
+    painter->fillRect(hud_rect_, QColor(0, 0, 0, 192));
+    painter->setFont(font_);
+    painter->setPen(Qt::white);
+    for (int i = 0 ; i < hud_lines_.size() ; i += 1)
+        painter->drawText(QPointF(hud_rect_.left() + HUD_PADDING,
+                                  hud_rect_.top() + HUD_PADDING + i * font_metrics_.lineSpacing() + font_metrics_.ascent()),
+                          hud_lines_[i]);
 }
 
 void NvimUIWidget::keyPressEvent(QKeyEvent* event) {
+    if (event->key() == Qt::Key_F12 && event->modifiers() == (Qt::ControlModifier | Qt::ShiftModifier)) {
+        this->toggleHud();
+        event->setAccepted(true);
+        return;
+    }
+
     std::string vim_keycodes = nvim_keycode_translate(event);
     qDebug() << "keyPressEvent" << event->key() << event->text() << event->modifiers() << vim_keycodes.size() << vim_keycodes.c_str();
     if (!vim_keycodes.empty()) {
@@ -275,7 +693,7 @@ QVariant NvimUIWidget::inputMethodQuery(Qt::InputMethodQuery query) const {
             return font_;
         case Qt::ImCursorRectangle:
             {
-                QPoint cursor = state_ ? state_->cursor : QPoint(0, 0);
+                QPoint cursor = this->inputCursorCell();
                 return QRect(grid_offset_.x() + cursor.x() * cell_size_.width(),
                              grid_offset_.y() + cursor.y() * cell_size_.height(),
                              cell_size_.width(), cell_size_.height());
@@ -292,7 +710,14 @@ void NvimUIWidget::inputMethodEvent(QInputMethodEvent* event) {
         << event->preeditString() << event->commitString()
         << event->replacementLength() << event->replacementStart();
 
-    QPoint cursor = state_ ? state_->cursor : QPoint(0, 0);
+    // the old preedit and the new one
+    QPoint cursor = this->inputCursorCell();
+    if (cursor != im_preedit_cell_ && !im_preedit_text_.isEmpty())
+        this->update(grid_offset_.x() + im_preedit_cell_.x() * cell_size_.width(),
+                     grid_offset_.y() + im_preedit_cell_.y() * cell_size_.height(),
+                     (grid_size_.width() - im_preedit_cell_.x()) * cell_size_.width(),
+                     cell_size_.height());
+    im_preedit_cell_ = cursor;
     im_preedit_text_ = event->preeditString();
     this->update(grid_offset_.x() + cursor.x() * cell_size_.width(),
                  grid_offset_.y() + cursor.y() * cell_size_.height(),
@@ -320,6 +745,28 @@ namespace {
     }
 }
 
+int NvimUIWidget::gridAt(QPoint pixel) const {
+    if (!state_)
+        return 1;
+
+    QPoint cell(std::floor((pixel.x() - grid_offset_.x()) / cell_size_.width()),
+                std::floor((pixel.y() - grid_offset_.y()) / cell_size_.height()));
+    // topmost first
+    for (auto it = state_->grids.rbegin() ; it != state_->grids.rend() ; ++it)
+        if (QRect(it->pos, it->size).contains(cell))
+            return it->id;
+    return 1;
+}
+
+void NvimUIWidget::setMouseCell(QPoint pixel, int grid_id, MouseInputParams& params) const {
+    NvimUIState::Grid const* grid = state_ ? state_->find_grid(grid_id) : nullptr;
+    QPoint grid_pos = grid ? grid->pos : QPoint(0, 0);
+
+    params.grid = grid ? grid_id : 1;
+    params.col = std::floor((pixel.x() - grid_offset_.x()) / cell_size_.width()) - grid_pos.x();
+    params.row = std::floor((pixel.y() - grid_offset_.y()) / cell_size_.height()) - grid_pos.y();
+}
+
 void NvimUIWidget::processMouseEvent(QMouseEvent* event) {
     MouseInputParams params;
     Qt::MouseButton event_btn = Qt::NoButton;
@@ -356,10 +803,12 @@ void NvimUIWidget::processMouseEvent(QMouseEvent* event) {
     }
 
     params.modifier = get_nvim_modifiers(event->modifiers());
-    params.col = (event->x() - grid_offset_.x()) / cell_size_.width();
-    params.row = (event->y() - grid_offset_.y()) / cell_size_.height();
+    // a drag stays on the grid it started from
+    if (params.action == "press")
+        pressed_grid_ = this->gridAt(event->pos());
+    this->setMouseCell(event->pos(), pressed_grid_, params);
 
-    qDebug() << "mouseEvent" << params.button.c_str() << params.action.c_str() << params.modifier.c_str() << params.col << params.row;
+    qDebug() << "mouseEvent" << params.button.c_str() << params.action.c_str() << params.modifier.c_str() << params.grid << params.col << params.row;
     emit mouseInput(params);
     event->setAccepted(true);
 }
@@ -378,8 +827,7 @@ void NvimUIWidget::wheelEvent(QWheelEvent* event) {
     MouseInputParams params;
     params.button = "wheel";
     params.modifier = get_nvim_modifiers(event->modifiers());
-    params.col = (event->x() - grid_offset_.x()) / cell_size_.width();
-    params.row = (event->y() - grid_offset_.y()) / cell_size_.height();
+    this->setMouseCell(event->pos(), this->gridAt(event->pos()), params);
 
     auto delta = event->angleDelta();
     if (std::abs(delta.x()) > std::abs(delta.y())) {  // horizontal
@@ -388,7 +836,7 @@ void NvimUIWidget::wheelEvent(QWheelEvent* event) {
         params.action = ((delta.y() > 0) ^ event->inverted()) ? "up" : "down";
     }
 
-    qDebug() << "wheelEvent" << params.action.c_str() << params.modifier.c_str() << params.col << params.row;
+    qDebug() << "wheelEvent" << params.action.c_str() << params.modifier.c_str() << params.grid << params.col << params.row;
     emit mouseInput(params);
     event->setAccepted(true);
 }
@@ -6,9 +6,14 @@
 #include <QCache>
 #include <QStaticText>
 #include <QFontMetricsF>
+#include <QPixmap>
+#include <QTimer>
 
 #include "./msgpack_rpc.h"
+#include "./dirty_spans.h"
 #include "./nvim_ui_state.h"
+#include "./nvim_ui_frame_mailbox.h"
+#include "./perf_stats.h"
 
 unsigned int qHash(QColor);
 
@@ -30,9 +35,47 @@ private:
     QPointF grid_offset_;
 
     QString im_preedit_text_;
+    QPoint im_preedit_cell_;  // where it was drawn last
     Qt::MouseButton pressed_mouse_btn_;
-
-    std::shared_ptr<NvimUIState> state_;
+    int pressed_grid_ = 1;
+
+    NvimUIFrameMailbox* frames_ = nullptr;
+    // the frame taken last, owned by frames_
+    NvimUIState const* state_ = nullptr;
+    uint64_t painted_frame_id_ = 0;
+
+    // Overlays as last taken, each cached in a pixmap. A popupmenu selection
+    // change only renders (and repaints) the two rows involved.
+    NvimUIState::Popupmenu shown_popupmenu_;
+    NvimUIState::Cmdline shown_cmdline_;
+    uint64_t overlay_highlights_version_ = 0;
+    QPixmap popupmenu_pixmap_;  // null: render all of it
+    std::vector<int> popupmenu_stale_rows_;
+    // the item on the first row; reset by each popupmenu_show (new items)
+    int popupmenu_first_ = 0;
+    QPixmap cmdline_pixmap_;
+    // shown_cmdline_ wrapped to the grid width, growing upward from the last row
+    struct CmdlineRun {
+        int highlight_id;
+        QPoint cell;  // row in the cmdline, column
+        int cells;
+        QString text;
+    };
+    std::vector<CmdlineRun> cmdline_runs_;
+    int cmdline_rows_ = 0;  // 0 if hidden
+    int cmdline_layout_width_ = 0;
+    QPoint cmdline_cursor_;  // row in the cmdline, column
+
+    // scratch buffers of damage conversion
+    mutable std::vector<QRect> damage_rects_;
+    DirtySpans redraw_cells_;
+
+    PerfStats* perf_stats_ = nullptr;
+    // stats overlay, refreshed on a timer while shown
+    bool hud_visible_ = false;
+    QTimer hud_timer_;
+    QStringList hud_lines_;
+    QRect hud_rect_;
 
     QCache<QPair<uint32_t, QString>, QStaticText> static_texts_;
     QCache<QColor, QPen> cache_pens_;
@@ -42,7 +85,8 @@ public:
         std::string button;
         std::string action;
         std::string modifier;
-        int row, col;
+        // row, col are in the grid
+        int grid, row, col;
     };
 
 signals:
@@ -51,20 +95,51 @@ signals:
     void mouseInput(MouseInputParams params);
 
 public slots:
-    void updateState(std::shared_ptr<NvimUIState> state,
-                     QRegion dirty_cells, bool defaults_updated);
+    // take the newest frame from frames_
+    void updateState();
+    // show or hide the stats overlay (also bound to Ctrl+Shift+F12)
+    void toggleHud();
 
 private:
 
     void calculateGrid();
     void processMouseEvent(QMouseEvent* event);
+    // the topmost grid at a pixel
+    int gridAt(QPoint pixel) const;
+    void setMouseCell(QPoint pixel, int grid_id, MouseInputParams& params) const;
 
     void paintDebugGrid(QPaintEvent* event, QPainter* painter);
 
+    QRect cellsToPixels(QRect const& cells) const;
+    QRegion spansToPixels(DirtySpans const& cells) const;
+    void pixelsToSpans(QRegion const& pixels, DirtySpans* cells) const;
+    // in global grid cells; empty if hidden
+    QRect popupmenuCells(NvimUIState::Popupmenu const& popupmenu) const;
+    // scrolled from `first` only as far as the selection needs
+    int popupmenuFirstItem(NvimUIState::Popupmenu const& popupmenu, int rows, int first) const;
+    // wraps shown_cmdline_ into cmdline_runs_
+    void layoutCmdline();
+    // of shown_cmdline_, as laid out
+    QRect cmdlineCells() const;
+    // in global grid cells: the cmdline cursor while it is shown, else the grid cursor
+    QPoint inputCursorCell() const;
+    // adds the pixels to repaint to `damage`
+    void updateOverlays(QRegion* damage);
+    void paintPopupmenu(QPainter* painter, QRegion const& redraw_region);
+    void renderPopupmenuRow(QPainter* painter, QRect const& cells, int row);
+    void paintCmdline(QPainter* painter, QRegion const& redraw_region);
+    void refreshHud();
+    void paintHud(QPainter* painter, QRegion const& redraw_region);
+
 public:
     NvimUIWidget(QWidget* parent=nullptr);
 
     void setFont(QFont const& font);
+    void setFrames(NvimUIFrameMailbox* frames) { frames_ = frames; }
+    void setPerfStats(PerfStats* perf_stats) { perf_stats_ = perf_stats; }
+    // What updateState() does, returning the pixels to repaint instead of
+    // scheduling the repaint (for rendering elsewhere, e.g. with render())
+    QRegion takeFrame();
     QSize grid_size() const { return grid_size_; }
 
 protected:
@@ -0,0 +1,111 @@
+#include "./perf_stats.h"
+#include "./msgpack_rpc.h"
+
+#include <QMutexLocker>
+
+#include <algorithm>
+#include <map>
+
+namespace {
+    msgpack::object summary_object(LatencyHistogram::Summary const& summary, msgpack::zone& zone) {
+        std::map<std::string, int64_t> ret({
+                {"count", int64_t(summary.count)},
+                {"mean_us", summary.mean_us},
+                {"p50_us", summary.p50_us},
+                {"p99_us", summary.p99_us},
+                {"max_us", summary.max_us}});
+        return msgpack::object(ret, zone);
+    }
+
+    QString summary_line(QString const& name, LatencyHistogram::Summary const& summary) {
+        return QString("%1 n=%2 mean=%3us p50<%4us p99<%5us max=%6us")
+            .arg(name).arg(summary.count).arg(summary.mean_us)
+            .arg(summary.p50_us).arg(summary.p99_us).arg(summary.max_us);
+    }
+}
+
+void PerfStats::set_redraw_events(std::vector<std::pair<char const*, uint64_t>> const& counts) {
+    QMutexLocker locker(&redraw_events_mutex_);
+    // names rarely change: reuse the strings
+    redraw_events_.resize(counts.size());
+    for (size_t i = 0 ; i < counts.size() ; i += 1) {
+        if (redraw_events_[i].first != counts[i].first)
+            redraw_events_[i].first = counts[i].first;
+        redraw_events_[i].second = counts[i].second;
+    }
+}
+
+std::vector<std::pair<std::string, uint64_t>> PerfStats::redraw_events() const {
+    QMutexLocker locker(&redraw_events_mutex_);
+    return redraw_events_;
+}
+
+QStringList PerfStats::describe() const {
+    QStringList ret;
+
+    uint64_t hits = static_text_hits.load(std::memory_order_relaxed);
+    uint64_t misses = static_text_misses.load(std::memory_order_relaxed);
+
+    ret << QString("read %1 KiB in %2 batches, %3 decode errors")
+        .arg(bytes_read.load(std::memory_order_relaxed) / 1024)
+        .arg(redraw_batches.load(std::memory_order_relaxed))
+        .arg(decode_errors.load(std::memory_order_relaxed));
+    ret << QString("flushes %1 (coalesced %2), frames taken %3, skipped %4")
+        .arg(flushes.load(std::memory_order_relaxed))
+        .arg(flushes_coalesced.load(std::memory_order_relaxed))
+        .arg(frames_taken.load(std::memory_order_relaxed))
+        .arg(frames_skipped.load(std::memory_order_relaxed));
+    ret << summary_line("calc ", calc_time.summary());
+    ret << summary_line("flush", flush_time.summary());
+    ret << summary_line("paint", paint_time.summary());
+    if (MsgpackRpc* rpc_source = rpc.load(std::memory_order_acquire))
+        for (auto const& it: rpc_source->latency_summary())
+            ret << summary_line(QString("rpc %1").arg(it.first.c_str()), it.second);
+    ret << QString("static text cache hits %1%")
+        .arg(hits + misses > 0 ? 100.0 * hits / (hits + misses) : 0.0, 0, 'f', 1);
+
+    // the busiest events
+    auto events = this->redraw_events();
+    std::sort(events.begin(), events.end(), [](auto const& a, auto const& b) { return a.second > b.second; });
+    QStringList event_texts;
+    for (size_t i = 0 ; i < std::min<size_t>(events.size(), 6) && events[i].second > 0 ; i += 1)
+        event_texts << QString("%1 %2").arg(events[i].first.c_str()).arg(events[i].second);
+    ret << event_texts.join(", ");
+
+    return ret;
+}
+
+msgpack::object PerfStats::to_object(msgpack::zone& zone) const {
+    std::map<std::string, msgpack::object> ret;
+
+    auto counter = [&](char const* name, std::atomic<uint64_t> const& value) {
+        ret[name] = msgpack::object(value.load(std::memory_order_relaxed), zone);
+    };
+    counter("bytes_read", bytes_read);
+    counter("redraw_batches", redraw_batches);
+    counter("flushes", flushes);
+    counter("flushes_coalesced", flushes_coalesced);
+    counter("frames_skipped", frames_skipped);
+    counter("decode_errors", decode_errors);
+    counter("frames_taken", frames_taken);
+    counter("static_text_hits", static_text_hits);
+    counter("static_text_misses", static_text_misses);
+
+    ret["calc_time"] = summary_object(calc_time.summary(), zone);
+    ret["flush_time"] = summary_object(flush_time.summary(), zone);
+    ret["paint_time"] = summary_object(paint_time.summary(), zone);
+
+    // round trips of our requests to nvim, per method
+    std::map<std::string, msgpack::object> rpc_latencies;
+    if (MsgpackRpc* rpc_source = rpc.load(std::memory_order_acquire))
+        for (auto const& it: rpc_source->latency_summary())
+            rpc_latencies[it.first] = summary_object(it.second, zone);
+    ret["rpc_time"] = msgpack::object(rpc_latencies, zone);
+
+    std::map<std::string, uint64_t> events;
+    for (auto const& it: this->redraw_events())
+        events.insert(it);
+    ret["redraw_events"] = msgpack::object(events, zone);
+
+    return msgpack::object(ret, zone);
+}
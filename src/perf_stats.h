@@ -0,0 +1,60 @@
+#pragma once
+
+#include <QMutex>
+#include <QStringList>
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <msgpack.hpp>
+
+#include "./latency_histogram.h"
+
+class MsgpackRpc;
+
+// Counters and latencies of each stage of the rendering pipeline, shown by the
+// widget's HUD and returned by the "neoterminal_stats" rpc request.
+// Each field is written by a single thread (noted below) and may be read from
+// any thread; counters use relaxed atomics, so they cost a plain add.
+struct PerfStats {
+    // rpc thread
+    std::atomic<uint64_t> bytes_read = {0};
+    // where the per-method request round trips are read from, if set
+    std::atomic<MsgpackRpc*> rpc = {nullptr};
+
+    // calc thread
+    std::atomic<uint64_t> redraw_batches = {0};
+    LatencyHistogram calc_time;  // applying a redraw batch
+    std::atomic<uint64_t> flushes = {0};
+    std::atomic<uint64_t> flushes_coalesced = {0};  // a later batch was already queued
+    LatencyHistogram flush_time;  // segmentation and snapshot of a flush
+    std::atomic<uint64_t> frames_skipped = {0};  // replaced before the widget took them
+    std::atomic<uint64_t> decode_errors = {0};
+
+    // gui thread
+    std::atomic<uint64_t> frames_taken = {0};
+    LatencyHistogram paint_time;
+    std::atomic<uint64_t> static_text_hits = {0};
+    std::atomic<uint64_t> static_text_misses = {0};
+
+    static void add(std::atomic<uint64_t>& counter, uint64_t n) {
+        // single writer: no need for a locked add
+        counter.store(counter.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    }
+
+    // calc thread: calls per redraw event name, handled or not
+    void set_redraw_events(std::vector<std::pair<char const*, uint64_t>> const& counts);
+    std::vector<std::pair<std::string, uint64_t>> redraw_events() const;
+
+    // for the HUD
+    QStringList describe() const;
+    // for rpc: a map of counters, histogram summaries and event counts
+    msgpack::object to_object(msgpack::zone& zone) const;
+
+private:
+    mutable QMutex redraw_events_mutex_;
+    std::vector<std::pair<std::string, uint64_t>> redraw_events_;
+};
@@ -0,0 +1,265 @@
+// Replays a recorded session through NvimUICalc and the NvimUIWidget paint
+// code as fast as possible, without a display, and reports throughput and
+// latencies. Useful to compare builds on the exact same input.
+//
+//   QT_QPA_PLATFORM=offscreen neoterminal-replay session.cap
+//
+// Input is a capture written by `neoterminal --capture FILE` (only what nvim
+// sent is replayed), or with --raw a plain msgpack-rpc stream as written by
+// nvim. Synthetic sessions: capture a run against neoterminal-fake-nvim.
+//
+//   --raw             the input is a raw stream, not a capture
+//   --repeat N        replay the session N times (default 1)
+//   --size WxH        widget size in pixels (default 1280x800)
+//   --no-paint        only run NvimUICalc
+//   --verbose         keep qDebug output (slows everything down)
+
+#include <QApplication>
+#include <QFile>
+#include <QImage>
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <new>
+#include <vector>
+
+#include <msgpack.hpp>
+
+#include "./msgpack_rpc.h"
+#include "./nvim_ui_calc.h"
+#include "./nvim_ui_widget.h"
+#include "./perf_stats.h"
+#include "./rpc_capture.h"
+
+// Every heap allocation is counted. On glibc malloc itself is interposed, which
+// also catches Qt's containers (they bypass operator new).
+namespace {
+    std::atomic<uint64_t> allocations = {0};
+}
+
+#ifdef __GLIBC__
+extern "C" {
+    void* __libc_malloc(size_t size);
+    void* __libc_calloc(size_t nmemb, size_t size);
+    void* __libc_realloc(void* ptr, size_t size);
+
+    void* malloc(size_t size) noexcept {
+        allocations.fetch_add(1, std::memory_order_relaxed);
+        return __libc_malloc(size);
+    }
+    void* calloc(size_t nmemb, size_t size) noexcept {
+        allocations.fetch_add(1, std::memory_order_relaxed);
+        return __libc_calloc(nmemb, size);
+    }
+    void* realloc(void* ptr, size_t size) noexcept {
+        allocations.fetch_add(1, std::memory_order_relaxed);
+        return __libc_realloc(ptr, size);
+    }
+}
+#else
+void* operator new(size_t size) {
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    if (void* ptr = std::malloc(size ? size : 1))
+        return ptr;
+    throw std::bad_alloc();
+}
+void* operator new[](size_t size) { return ::operator new(size); }
+void operator delete(void* ptr) noexcept { std::free(ptr); }
+void operator delete[](void* ptr) noexcept { std::free(ptr); }
+void operator delete(void* ptr, size_t) noexcept { std::free(ptr); }
+void operator delete[](void* ptr, size_t) noexcept { std::free(ptr); }
+#endif
+
+namespace {
+
+struct Options {
+    QString path;
+    bool raw = false;
+    int repeat = 1;
+    QSize size = QSize(1280, 800);
+    bool paint = true;
+    bool verbose = false;
+};
+
+void usage(const char* argv0) {
+    fprintf(stderr, "Usage: %s [--raw] [--repeat N] [--size WxH] [--no-paint] [--verbose] FILE\n", argv0);
+}
+
+// decodes the redraw notifications out of a stream of msgpack-rpc messages
+class RedrawCollector {
+public:
+    void feed(const char* data, size_t size) {
+        unpacker_.reserve_buffer(size);
+        memcpy(unpacker_.buffer(), data, size);
+        unpacker_.buffer_consumed(size);
+
+        msgpack::object_handle handle;
+        while (unpacker_.next(handle)) {
+            msgpack::object obj = handle.get();
+            if (obj.type != msgpack::type::ARRAY || obj.via.array.size != 3
+                || obj.via.array.ptr[0].type != msgpack::type::POSITIVE_INTEGER
+                || obj.via.array.ptr[0].via.u64 != 2
+                || obj.via.array.ptr[1].type != msgpack::type::STR
+                || obj.via.array.ptr[2].type != msgpack::type::ARRAY)
+                continue;  // responses, requests, and other notifications
+
+            auto const& method = obj.via.array.ptr[1].via.str;
+            if (std::string(method.ptr, method.size) != "redraw")
+                continue;
+
+            auto notification = std::make_shared<MsgpackNotification>();
+            notification->method = "redraw";
+            notification->params = obj.via.array.ptr[2];
+            notification->handle = std::move(handle);
+            batches.push_back(std::move(notification));
+        }
+    }
+
+    std::vector<notification_ptr_t> batches;
+
+private:
+    msgpack::unpacker unpacker_;
+};
+
+bool load(Options const& options, RedrawCollector* collector) {
+    if (options.raw) {
+        QFile file(options.path);
+        if (!file.open(QIODevice::ReadOnly)) {
+            fprintf(stderr, "Unable to open %s\n", qPrintable(options.path));
+            return false;
+        }
+        QByteArray data = file.readAll();
+        collector->feed(data.constData(), data.size());
+        return true;
+    }
+
+    RpcCaptureReader reader;
+    if (!reader.open(options.path))
+        return false;
+    RpcCaptureReader::Record record;
+    while (reader.next(record))
+        if (record.direction == rpc_capture::FROM_NVIM)
+            collector->feed(record.data, record.size);
+    return true;
+}
+
+void print_summary(const char* name, LatencyHistogram const& histogram) {
+    auto summary = histogram.summary();
+    printf("%-6s n=%-8llu mean=%6lldus p50<%6lldus p99<%6lldus max=%6lldus\n", name,
+           (unsigned long long)summary.count, (long long)summary.mean_us,
+           (long long)summary.p50_us, (long long)summary.p99_us, (long long)summary.max_us);
+}
+
+bool quiet_debug = true;
+
+void message_handler(QtMsgType type, QMessageLogContext const& context, QString const& message) {
+    if (type == QtDebugMsg && quiet_debug)
+        return;
+    fprintf(stderr, "%s\n", qPrintable(qFormatLogMessage(type, context, message)));
+}
+
+}
+
+int main(int argc, char* argv[]) {
+    // before QApplication: no display needed
+    if (qEnvironmentVariableIsEmpty("QT_QPA_PLATFORM"))
+        qputenv("QT_QPA_PLATFORM", "offscreen");
+
+    Options options;
+    for (int i = 1 ; i < argc ; i += 1) {
+        bool has_value = i + 1 < argc;
+        if (strcmp(argv[i], "--raw") == 0)
+            options.raw = true;
+        else if (strcmp(argv[i], "--repeat") == 0 && has_value)
+            options.repeat = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--size") == 0 && has_value) {
+            int width = 0, height = 0;
+            if (sscanf(argv[++i], "%dx%d", &width, &height) != 2 || width <= 0 || height <= 0) {
+                usage(argv[0]);
+                return 2;
+            }
+            options.size = QSize(width, height);
+        } else if (strcmp(argv[i], "--no-paint") == 0)
+            options.paint = false;
+        else if (strcmp(argv[i], "--verbose") == 0)
+            options.verbose = true;
+        else if (argv[i][0] != '-' && options.path.isEmpty())
+            options.path = QString::fromLocal8Bit(argv[i]);
+        else {
+            usage(argv[0]);
+            return 2;
+        }
+    }
+    if (options.path.isEmpty() || options.repeat <= 0) {
+        usage(argv[0]);
+        return 2;
+    }
+
+    quiet_debug = !options.verbose;
+    qInstallMessageHandler(message_handler);
+
+    QApplication app(argc, argv);
+
+    RedrawCollector collector;
+    if (!load(options, &collector))
+        return 1;
+    if (collector.batches.empty()) {
+        fprintf(stderr, "No redraw batches in %s\n", qPrintable(options.path));
+        return 1;
+    }
+
+    PerfStats perf_stats;
+    NvimUICalc calc;
+    calc.set_perf_stats(&perf_stats);
+
+    NvimUIWidget widget;
+    widget.setPerfStats(&perf_stats);
+    widget.setFrames(calc.frames());
+    // "shown" so that it lays out its grid, without ever reaching a screen
+    widget.setAttribute(Qt::WA_DontShowOnScreen);
+    widget.resize(options.size);
+    widget.show();
+
+    QImage image(options.size, QImage::Format_ARGB32_Premultiplied);
+    image.fill(Qt::black);
+
+    // direct connection: the frame is rendered before the next batch is applied
+    uint64_t frames = 0;
+    QObject::connect(&calc, &NvimUICalc::updated, [&]() {
+        QRegion damage = widget.takeFrame();
+        frames += 1;
+        if (options.paint && !damage.isEmpty())
+            widget.render(&image, damage.boundingRect().topLeft(), damage);
+    });
+
+    uint64_t allocations_before = allocations.load(std::memory_order_relaxed);
+    auto t0 = std::chrono::steady_clock::now();
+
+    for (int i = 0 ; i < options.repeat ; i += 1)
+        for (auto const& batch: collector.batches)
+            calc.redraw(batch);
+
+    auto t1 = std::chrono::steady_clock::now();
+    uint64_t allocations_during = allocations.load(std::memory_order_relaxed) - allocations_before;
+
+    double seconds = std::chrono::duration<double>(t1 - t0).count();
+    uint64_t events = 0;
+    for (auto const& it: perf_stats.redraw_events())
+        events += it.second;
+
+    printf("%s: %zu batches x %d in %.3f s\n",
+           qPrintable(options.path), collector.batches.size(), options.repeat, seconds);
+    printf("events/s   %.0f (%llu events)\n", events / seconds, (unsigned long long)events);
+    printf("flushes/s  %.0f (%llu frames)\n", frames / seconds, (unsigned long long)frames);
+    print_summary("calc", perf_stats.calc_time);
+    print_summary("flush", perf_stats.flush_time);
+    if (options.paint)
+        print_summary("paint", perf_stats.paint_time);
+    printf("allocs/frame %.1f\n", frames > 0 ? double(allocations_during) / frames : 0.0);
+
+    return 0;
+}
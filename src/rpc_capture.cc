@@ -0,0 +1,90 @@
+#include "./rpc_capture.h"
+
+#include <QDebug>
+
+#include <cstring>
+
+const char rpc_capture::MAGIC[8] = {'N', 'V', 'R', 'P', 'C', 'C', 'A', 'P'};
+
+bool RpcCaptureWriter::open(QString const& path) {
+    file_.setFileName(path);
+    if (!file_.open(QIODevice::WriteOnly | QIODevice::Truncate)) {
+        qWarning() << "Unable to open capture file" << path << file_.errorString();
+        return false;
+    }
+
+    rpc_capture::FileHeader header;
+    memcpy(header.magic, rpc_capture::MAGIC, sizeof(header.magic));
+    header.version = rpc_capture::VERSION;
+    header.reserved = 0;
+    file_.write(reinterpret_cast<const char*>(&header), sizeof(header));
+
+    start_ = std::chrono::steady_clock::now();
+    return true;
+}
+
+void RpcCaptureWriter::append(rpc_capture::Direction direction, const char* data, size_t size) {
+    if (!file_.isOpen() || size == 0)
+        return;
+
+    rpc_capture::RecordHeader header;
+    memset(&header, 0, sizeof(header));
+    header.timestamp_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - start_).count();
+    header.size = size;
+    header.direction = direction;
+
+    static const char zeros[8] = {};
+
+    file_.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    file_.write(data, size);
+    file_.write(zeros, rpc_capture::padded_size(size) - size);
+}
+
+void RpcCaptureWriter::flush() {
+    if (file_.isOpen())
+        file_.flush();
+}
+
+bool RpcCaptureReader::open(QString const& path) {
+    file_.setFileName(path);
+    if (!file_.open(QIODevice::ReadOnly)) {
+        qWarning() << "Unable to open capture file" << path << file_.errorString();
+        return false;
+    }
+
+    size_ = file_.size();
+    data_ = size_ > 0 ? file_.map(0, size_) : nullptr;
+    if (!data_ || size_ < sizeof(rpc_capture::FileHeader)
+        || memcmp(data_, rpc_capture::MAGIC, sizeof(rpc_capture::MAGIC)) != 0) {
+        qWarning() << "Not a capture file" << path;
+        return false;
+    }
+
+    auto header = reinterpret_cast<const rpc_capture::FileHeader*>(data_);
+    if (header->version != rpc_capture::VERSION) {
+        qWarning() << "Unsupported capture version" << header->version;
+        return false;
+    }
+
+    offset_ = sizeof(rpc_capture::FileHeader);
+    return true;
+}
+
+bool RpcCaptureReader::next(Record& record) {
+    if (offset_ + sizeof(rpc_capture::RecordHeader) > size_)
+        return false;
+
+    auto header = reinterpret_cast<const rpc_capture::RecordHeader*>(data_ + offset_);
+    size_t data_offset = offset_ + sizeof(rpc_capture::RecordHeader);
+    if (data_offset + header->size > size_)
+        return false;  // truncated, the writer was killed mid-record
+
+    record.timestamp_ns = header->timestamp_ns;
+    record.direction = static_cast<rpc_capture::Direction>(header->direction);
+    record.data = reinterpret_cast<const char*>(data_ + data_offset);
+    record.size = header->size;
+
+    offset_ = data_offset + rpc_capture::padded_size(header->size);
+    return true;
+}
@@ -0,0 +1,89 @@
+#pragma once
+
+#include <QFile>
+#include <QString>
+
+#include <chrono>
+#include <cstdint>
+#include <memory>
+
+// Capture of the raw byte stream between us and nvim.
+//
+// Layout (host byte order, every header 8-byte aligned so that a mapped file
+// can be walked in place):
+//   file header:  char magic[8] = "NVRPCCAP", uint32 version, uint32 reserved
+//   records:      uint64 timestamp_ns  (monotonic, since the capture started)
+//                 uint32 size
+//                 uint8  direction     (see Direction)
+//                 uint8  reserved[3]
+//                 size bytes of data, zero padded to a multiple of 8
+// The file is append-only; a truncated last record marks the end.
+
+namespace rpc_capture {
+
+enum Direction: uint8_t {
+    FROM_NVIM = 0,
+    TO_NVIM = 1,
+};
+
+struct FileHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t reserved;
+};
+
+struct RecordHeader {
+    uint64_t timestamp_ns;
+    uint32_t size;
+    uint8_t direction;
+    uint8_t reserved[3];
+};
+
+static_assert(sizeof(FileHeader) == 16, "unexpected FileHeader padding");
+static_assert(sizeof(RecordHeader) == 16, "unexpected RecordHeader padding");
+
+extern const char MAGIC[8];
+const uint32_t VERSION = 1;
+
+inline size_t padded_size(size_t size) {
+    return (size + 7) & ~size_t(7);
+}
+
+}
+
+class RpcCaptureWriter {
+public:
+    // truncates the file
+    bool open(QString const& path);
+    bool is_open() const { return file_.isOpen(); }
+
+    void append(rpc_capture::Direction direction, const char* data, size_t size);
+    // push what is buffered to the OS; called once per event loop turn
+    void flush();
+
+private:
+    QFile file_;
+    std::chrono::steady_clock::time_point start_;
+};
+
+class RpcCaptureReader {
+public:
+    struct Record {
+        uint64_t timestamp_ns;
+        rpc_capture::Direction direction;
+        const char* data;
+        size_t size;
+    };
+
+    // maps the whole file
+    bool open(QString const& path);
+
+    // false at the end of the capture
+    bool next(Record& record);
+
+private:
+    QFile file_;
+    const uchar* data_ = nullptr;
+    size_t size_ = 0;
+    size_t offset_ = 0;
+};
@@ -0,0 +1,181 @@
+#include "./tracer.h"
+
+#include <QDebug>
+#include <QFile>
+#include <QMutex>
+#include <QMutexLocker>
+#include <QThread>
+#include <QCoreApplication>
+
+#include <algorithm>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+// events per thread: 32 bytes each
+#define TRACE_RING_SIZE (1 << 16)
+
+namespace tracer {
+
+std::atomic<bool> enabled_ = {false};
+
+namespace {
+    struct Event {
+        char const* name;
+        int64_t begin_ns;
+        int64_t duration_ns;
+        uint64_t frame_id : 56;
+        uint64_t phase : 8;
+    };
+    static_assert(sizeof(Event) == 32, "unexpected Event padding");
+
+    // written by its thread only
+    struct Ring {
+        int tid = 0;
+        QString thread_name;
+        std::unique_ptr<Event[]> events;
+        // events written so far; the newest is at (head - 1) % TRACE_RING_SIZE
+        std::atomic<uint64_t> head = {0};
+    };
+
+    // Rings outlive their threads, so they can be dumped after those exit.
+    // Pool threads come and go (they expire when idle), so the ring of an
+    // exited thread is handed to the next new thread, which appends to it.
+    QMutex rings_mutex;
+    std::vector<std::unique_ptr<Ring>> rings;
+    std::vector<Ring*> free_rings;
+    thread_local Ring* thread_ring = nullptr;
+
+    // destroyed when its thread exits
+    struct RingRelease {
+        ~RingRelease() {
+            QMutexLocker locker(&rings_mutex);
+            free_rings.push_back(thread_ring);
+            thread_ring = nullptr;
+        }
+    };
+
+    Ring* register_thread() {
+        QThread* thread = QThread::currentThread();
+        QString thread_name = thread->objectName();
+        if (thread_name.isEmpty() && QCoreApplication::instance()
+            && thread == QCoreApplication::instance()->thread())
+            thread_name = "gui";
+
+        Ring* ring = nullptr;
+        {
+            QMutexLocker locker(&rings_mutex);
+            if (!free_rings.empty()) {
+                ring = free_rings.back();
+                free_rings.pop_back();
+            } else {
+                rings.emplace_back(new Ring);
+                ring = rings.back().get();
+                ring->events.reset(new Event[TRACE_RING_SIZE]);
+                ring->tid = rings.size();
+            }
+            if (thread_name.isEmpty())
+                thread_name = QString("thread %1").arg(ring->tid);
+            ring->thread_name = thread_name;
+        }
+
+        thread_ring = ring;
+        thread_local RingRelease release;
+        return ring;
+    }
+
+    void append_json_event(QByteArray& out, Event const& event, int tid, int64_t epoch_ns) {
+        // ts and dur are in microseconds
+        out += "{\"name\":\"";
+        out += event.name;
+        out += "\",\"cat\":\"neoterminal\",\"ph\":\"";
+        out += char(event.phase);
+        out += "\",\"pid\":1,\"tid\":";
+        out += QByteArray::number(tid);
+        out += ",\"ts\":";
+        out += QByteArray::number((event.begin_ns - epoch_ns) / 1000.0, 'f', 3);
+        if (event.phase == COMPLETE) {
+            out += ",\"dur\":";
+            out += QByteArray::number(event.duration_ns / 1000.0, 'f', 3);
+            if (event.frame_id != 0) {
+                out += ",\"args\":{\"frame\":";
+                out += QByteArray::number(qulonglong(event.frame_id));
+                out += "}";
+            }
+        } else {
+            out += ",\"id\":";
+            out += QByteArray::number(qulonglong(event.frame_id));
+            // bind to the enclosing span rather than the next one
+            if (event.phase != FLOW_BEGIN)
+                out += ",\"bp\":\"e\"";
+        }
+        out += "},\n";
+    }
+}
+
+void set_enabled(bool enabled) {
+    qDebug() << "Tracing" << (enabled ? "enabled" : "disabled");
+    enabled_.store(enabled, std::memory_order_relaxed);
+}
+
+void record(Phase phase, char const* name, int64_t begin_ns, int64_t duration_ns, uint64_t frame_id) {
+    Ring* ring = thread_ring;
+    if (!ring)
+        ring = register_thread();
+
+    uint64_t head = ring->head.load(std::memory_order_relaxed);
+    Event& event = ring->events[head % TRACE_RING_SIZE];
+    event.name = name;
+    event.begin_ns = begin_ns;
+    event.duration_ns = duration_ns;
+    event.frame_id = frame_id;
+    event.phase = phase;
+    ring->head.store(head + 1, std::memory_order_release);
+}
+
+int64_t dump(QString const& path) {
+    QFile file(path);
+    if (!file.open(QIODevice::WriteOnly | QIODevice::Truncate)) {
+        qWarning() << "Unable to open trace file" << path << file.errorString();
+        return -1;
+    }
+
+    QMutexLocker locker(&rings_mutex);
+
+    // timestamps relative to the oldest event kept, for readable numbers
+    int64_t epoch_ns = INT64_MAX;
+    for (auto const& ring: rings) {
+        uint64_t head = ring->head.load(std::memory_order_acquire);
+        uint64_t first = head > TRACE_RING_SIZE ? head - TRACE_RING_SIZE : 0;
+        if (first < head)
+            epoch_ns = std::min(epoch_ns, ring->events[first % TRACE_RING_SIZE].begin_ns);
+    }
+
+    int64_t nevents = 0;
+    QByteArray out = "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+    for (auto const& ring: rings) {
+        out += "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":";
+        out += QByteArray::number(ring->tid);
+        out += ",\"args\":{\"name\":\"";
+        out += ring->thread_name.toUtf8();
+        out += "\"}},\n";
+
+        uint64_t head = ring->head.load(std::memory_order_acquire);
+        uint64_t first = head > TRACE_RING_SIZE ? head - TRACE_RING_SIZE : 0;
+        for (uint64_t i = first ; i < head ; i += 1) {
+            append_json_event(out, ring->events[i % TRACE_RING_SIZE], ring->tid, epoch_ns);
+            nevents += 1;
+        }
+
+        file.write(out);
+        out.clear();
+    }
+    // JSON has no trailing commas: close with a no-op metadata event
+    out += "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"args\":{\"name\":\"neoterminal\"}}\n]}\n";
+    file.write(out);
+
+    qDebug() << "Dumped" << nevents << "trace events to" << path;
+    return nevents;
+}
+
+}
@@ -0,0 +1,77 @@
+#pragma once
+
+#include <QString>
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+// Opt-in tracer of the read -> calc -> flush -> paint pipeline, dumped as
+// Chrome trace-event JSON (chrome://tracing, ui.perfetto.dev).
+//
+// Each thread records into its own ring buffer, so recording takes no lock;
+// the oldest events are overwritten. The ring of an exited thread is reused
+// by the next new one, so there are at most as many rings as live threads
+// ever were at once. While disabled, a TRACE_SCOPE costs a
+// relaxed load and a branch.
+//
+// Spans may carry a frame id: the id of the NvimUIState frame the work ends
+// up in. Flow events chain a frame from its flush to the paint showing it.
+namespace tracer {
+
+enum Phase: char {
+    COMPLETE = 'X',
+    FLOW_BEGIN = 's',
+    FLOW_STEP = 't',
+    FLOW_END = 'f',
+};
+
+extern std::atomic<bool> enabled_;
+
+inline bool enabled() { return enabled_.load(std::memory_order_relaxed); }
+void set_enabled(bool enabled);
+
+inline int64_t now_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// name must be a string literal (only the pointer is kept)
+void record(Phase phase, char const* name, int64_t begin_ns, int64_t duration_ns, uint64_t frame_id);
+
+// Writes the events of all threads. Threads keep recording meanwhile: events
+// overwritten during the dump may come out garbled. Returns the number of events.
+int64_t dump(QString const& path);
+
+class Scope {
+public:
+    explicit Scope(char const* name, uint64_t frame_id=0):
+    name_(name), frame_id_(frame_id), begin_ns_(enabled() ? now_ns() : 0) {}
+    ~Scope() {
+        if (begin_ns_ != 0)
+            record(COMPLETE, name_, begin_ns_, now_ns() - begin_ns_, frame_id_);
+    }
+    // known only once the work is done
+    void set_frame_id(uint64_t frame_id) { frame_id_ = frame_id; }
+
+    Scope(Scope const&) = delete;
+    Scope& operator=(Scope const&) = delete;
+
+private:
+    char const* name_;
+    uint64_t frame_id_;
+    int64_t begin_ns_;
+};
+
+inline void flow(Phase phase, uint64_t frame_id) {
+    if (enabled())
+        record(phase, "frame", now_ns(), 0, frame_id);
+}
+
+}
+
+#define TRACE_CONCAT_INNER(A, B) A ## B
+#define TRACE_CONCAT(A, B) TRACE_CONCAT_INNER(A, B)
+// a span over the rest of the enclosing block
+#define TRACE_SCOPE(NAME) tracer::Scope TRACE_CONCAT(trace_scope_, __LINE__)(NAME)
+#define TRACE_SCOPE_FRAME(NAME, FRAME_ID) tracer::Scope TRACE_CONCAT(trace_scope_, __LINE__)(NAME, FRAME_ID)